@@ -1,9 +1,41 @@
 [bits 32]
 STACK_SIZE equ 0x4000 ; Define stack size as 16 KB
 
+; The kernel is linked at its load address plus KERNEL_VIRT_BASE (see
+; linker.ld), so until paging is on every absolute address has to be
+; brought back down by it
+KERNEL_VIRT_BASE equ 0xC0000000
+PDE_LARGE        equ 0x83           ; Present, writable, large page
+PDE_TABLE        equ 0x03           ; Present, writable
+
+; Built with PAE, entries are 8 bytes and four directories of 512 entries sit
+; back to back behind a page directory pointer table, see paging.h
+%ifdef __PHYSICAL_MEMORY_EXTENSION__
+PDE_SIZE         equ 8
+PDE_SHIFT        equ 21             ; 2 MiB pages
+RECURSIVE_PDE    equ 2044
+RECURSIVE_COUNT  equ 4
+PDPT_ENTRIES     equ 4
+PDPTE_PRESENT    equ 0x01           ; Nothing else is allowed in a PDPT entry
+CR4_PAGING       equ 0x20           ; PAE
+CPUID_1_EDX_PAGING equ 1 << 6
+%else
+PDE_SIZE         equ 4
+PDE_SHIFT        equ 22             ; 4 MiB pages
+RECURSIVE_PDE    equ 1023
+RECURSIVE_COUNT  equ 1
+CR4_PAGING       equ 0x10           ; PSE
+CPUID_1_EDX_PAGING equ 1 << 3
+%endif
+KERNEL_PDE       equ KERNEL_VIRT_BASE >> PDE_SHIFT
+
 [extern kernel_main]
 [extern _edata]
 [extern _end]
+[extern page_directory]
+%ifdef __PHYSICAL_MEMORY_EXTENSION__
+[extern page_dir_pointers]
+%endif
 
 [global multiboot_data]
 
@@ -44,10 +76,10 @@ ADDRESS_TAG_START:
     dw 2 ; type=addr
     dw 0 ; flags=0
     dd ADDRESS_TAG_END - ADDRESS_TAG_START ; size
-    dd multiboot2_header_start ; header start addr
-    dd _start ; kernel loader
-    dd _edata ; code end
-    dd _end ; bss end
+    dd multiboot2_header_start - KERNEL_VIRT_BASE ; header start addr
+    dd _start - KERNEL_VIRT_BASE ; kernel loader
+    dd _edata - KERNEL_VIRT_BASE ; code end
+    dd _end - KERNEL_VIRT_BASE ; bss end
 ADDRESS_TAG_END:
 
 align 8
@@ -56,7 +88,7 @@ ENTRY_TAG_START:
     dw 3                     ; Tag type (3 for entry address)
     dw 0                     ; Flags (set to 0 for standard use)
     dd ENTRY_TAG_END - ENTRY_TAG_START ; Tag size (8 bytes)
-    dd full_start            ; Entry point address (physical address)
+    dd full_start - KERNEL_VIRT_BASE ; Entry point address (physical address)
 ENTRY_TAG_END:
 
 align 8
@@ -90,10 +122,88 @@ section .text
 full_start:
     cli
     
-    mov [multiboot_data], eax
-    mov [multiboot_data + 4], ebx
-
-    
+    mov [multiboot_data - KERNEL_VIRT_BASE], eax
+    mov [multiboot_data - KERNEL_VIRT_BASE + 4], ebx
+
+    ; The boot page directory is made of large pages, which take PSE, or
+    ; PAE when built for it
+    mov eax, 1
+    cpuid
+    test edx, CPUID_1_EDX_PAGING
+    jz HALT
+
+    ; Build it in page_directory, which GRUB zeroed with the rest of .bss.
+    ; Everything below the kernel window is identity mapped, so the multiboot
+    ; info, the ACPI tables and every frame stay reachable until paging_init
+    ; trims the map down to what is really there. The high dword of PAE
+    ; entries stays zero.
+    mov edi, page_directory - KERNEL_VIRT_BASE
+    xor ecx, ecx
+.identity:
+    mov eax, ecx
+    shl eax, PDE_SHIFT
+    or eax, PDE_LARGE
+    mov [edi + ecx * PDE_SIZE], eax
+    inc ecx
+    cmp ecx, KERNEL_PDE
+    jb .identity
+
+    ; The kernel image again at KERNEL_VIRT_BASE
+    mov edx, _end - KERNEL_VIRT_BASE + (1 << PDE_SHIFT) - 1
+    shr edx, PDE_SHIFT
+    xor ecx, ecx
+.kernel:
+    mov eax, ecx
+    shl eax, PDE_SHIFT
+    or eax, PDE_LARGE
+    mov [edi + (KERNEL_PDE * PDE_SIZE) + ecx * PDE_SIZE], eax
+    inc ecx
+    cmp ecx, edx
+    jb .kernel
+
+    ; The last entries point at the directories themselves, so the page
+    ; tables show up at the top of the address space (0xFFC00000, or
+    ; 0xFF800000 with PAE)
+    xor ecx, ecx
+.recursive:
+    mov eax, ecx
+    shl eax, 12
+    add eax, edi
+    or eax, PDE_TABLE
+    mov [edi + (RECURSIVE_PDE * PDE_SIZE) + ecx * PDE_SIZE], eax
+    inc ecx
+    cmp ecx, RECURSIVE_COUNT
+    jb .recursive
+
+%ifdef __PHYSICAL_MEMORY_EXTENSION__
+    ; One pointer per directory, CR3 takes the pointer table
+    mov esi, page_dir_pointers - KERNEL_VIRT_BASE
+    xor ecx, ecx
+.pointers:
+    mov eax, ecx
+    shl eax, 12
+    add eax, edi
+    or eax, PDPTE_PRESENT
+    mov [esi + ecx * 8], eax
+    inc ecx
+    cmp ecx, PDPT_ENTRIES
+    jb .pointers
+    mov edi, esi
+%endif
+
+    mov eax, cr4
+    or eax, CR4_PAGING
+    mov cr4, eax
+    mov cr3, edi
+    mov eax, cr0
+    or eax, 0x80000001
+    mov cr0, eax
+
+    ; Leave the identity mapped copy for the linked addresses
+    mov eax, higher_half
+    jmp eax
+
+higher_half:
     ; Initialize the stack pointer
     lea esp, [stack + STACK_SIZE]
     ; Reset EFLAGS
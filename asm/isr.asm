@@ -38,6 +38,7 @@ isr_common:
     mov fs, ax
     mov gs, ax
     
+    cld                 ; C expects DF clear, a backward memmove may have set it (iret restores it)
     push esp            ; pass pointer to stack to C, so we can access all the pushed information
     call ISR_Handler
     add esp, 4
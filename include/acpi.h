@@ -229,6 +229,10 @@ typedef struct {
     mcfg_allocation_t allocations[]; // Offset 44: Array of allocation entries
 } __attribute__((packed)) mcfg_table_t;
 
+// Each bus has 32 devices with 8 functions and 4 KiB of registers each
+#define PCIE_ECAM_BUS_SIZE      0x100000
+#define PCIE_ECAM_FUNCTION(_device, _function) (((uint32_t)(_device) << 15) | ((uint32_t)(_function) << 12))
+
 
 // SSDT Table
 typedef struct {
@@ -273,6 +277,7 @@ extern uint8_t  acpi_rval;
 extern uint8_t *S4BIOS_REQ;
 
 extern mcfg_allocation_t *PCIe_data;
+extern uint32_t PCIe_count;
 extern hpet_table_t *hpet_data;
 extern acpi_header_t *rsdt_data;
 
@@ -287,6 +292,9 @@ void acpi_parse_facp(facp_table_t *facp_table);
 void acpi_parse_apic(madt_table_t *apic_table);
 void acpi_parse_hpet(hpet_table_t *hpet_table);
 void acpi_parse_mcfg(mcfg_table_t *mcfg_table);
+// Mapped configuration space of one PCIe function, 0xFFFFFFFF if no MCFG entry covers it.
+// Each bus is mapped once and kept, callers never iounmap the result.
+volatile void *pcie_config_address(uint16_t segment, uint8_t bus, uint8_t device, uint8_t function);
 void acpi_parse_ssdt(ssdt_table_t *ssdt_table);
 void acpi_parse_rsdt(acpi_header_t *rsdt_table);
 void acpi_parse_xsdt(acpi_header_t *xsdt_table);
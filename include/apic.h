@@ -14,6 +14,9 @@
 #define APIC_LVT_TIMER              0x320 // Local Vector Table Timer Register
 #define APIC_LVT_LINT0              0x350 // Local Vector Table LINT0 Register
 #define APIC_LVT_LINT1              0x360 // Local Vector Table LINT1 Register
+#define APIC_ICR_LOW                0x300 // Interrupt Command Register, writing it sends the IPI
+#define APIC_ICR_HIGH               0x310 // Destination field of the Interrupt Command Register
+#define APIC_ICR_ALL_BUT_SELF       0x000C0000 // Destination shorthand: every other CPU
 
 
 #define APIC_BASE                   0xFEE00000 // APIC Base Address (commonly defined, can vary)
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ---------------------------------------------------------------------------
+// Bump arena
+//
+// Memory that lives as long as the arena, carved linearly out of page frame
+// chunks. Allocation is a pointer bump, there is no per-object free: the
+// whole arena is either reset (everything goes back to the frame allocator)
+// or sealed (kept forever, no further allocations).
+// ---------------------------------------------------------------------------
+#define ARENA_CHUNK_ORDER 2   // Chunks are at least 16 KiB
+
+typedef struct arena_chunk {
+    struct arena_chunk *next; // Previously filled chunk
+    uint32_t order;           // Frame order the chunk was allocated with
+    uint32_t used;            // Bytes handed out, including this header
+    uint32_t size;            // Bytes in the chunk
+} arena_chunk_t;
+
+typedef struct {
+    const char *name;
+    arena_chunk_t *chunks;    // Current chunk, older ones chained through next
+    uint32_t bytes;           // Bytes handed out over all chunks
+    uint32_t chunk_count;
+    uint8_t sealed;
+} arena_t;
+
+// Holds the tables parsed while booting (ACPI and friends), sealed once HAL is up
+extern arena_t boot_arena;
+
+void arena_init(arena_t *arena, const char *name);
+void *arena_alloc(arena_t *arena, size_t size, size_t alignment);
+void arena_reset(arena_t *arena);
+void arena_seal(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,92 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ---------------------------------------------------------------------------
+// Clock events
+//
+// There is no periodic tick. Timers sit in one queue sorted by expiry, and
+// the best interrupt source the machine has is armed in one-shot mode for
+// the earliest of them only. When that interrupt comes in, every timer that
+// is due runs and the source is armed again for the next one, or left
+// stopped when the queue is empty, so an idle machine takes no timer
+// interrupts and a timer 50 us out fires 50 us out instead of on the next
+// tick.
+//
+// Time is the TSC scaled to nanoseconds since the clock was calibrated.
+// Devices take a relative delta and are rated, the highest rating that
+// registers is the one used: TSC-deadline, then the local APIC timer, then
+// an HPET comparator, then the PIT.
+// ---------------------------------------------------------------------------
+#define CLOCK_NS_PER_SEC    1000000000ULL
+#define CLOCK_SCALE_SHIFT   24
+
+typedef struct {
+    const char *name;
+    uint32_t rating;
+    uint64_t min_delta_ns;      // Shorter deltas are rounded up to this
+    uint64_t max_delta_ns;      // Longer waits are armed in steps of this
+    // Arm one interrupt 'delta_ns' from now. False when the device could
+    // tell the time had already passed by the time it was armed.
+    bool (*set_next)(uint64_t delta_ns);
+    void (*stop)();
+} clockevent_device_t;
+
+typedef void (*timer_callback_t)(void *data);
+
+typedef struct timer_event {
+    uint64_t expires_ns;
+    timer_callback_t callback;  // Runs from the timer interrupt
+    void *data;
+    bool queued;
+    struct timer_event *next;
+} timer_event_t;
+
+// (value * mult) >> shift without overflowing the 64-bit product, for
+// shift <= 32. Good while the result itself fits in 64 bits.
+static inline uint64_t clock_scale(uint64_t value, uint32_t mult, uint32_t shift) {
+    uint64_t low = (uint64_t)(uint32_t)value * mult;
+    uint64_t high = (uint64_t)(uint32_t)(value >> 32) * mult;
+    return (high << (32 - shift)) + (low >> shift);
+}
+
+// 64 by 32 bit division in two divl steps, there is no libgcc to call
+static inline uint64_t clock_div(uint64_t value, uint32_t divisor) {
+    uint32_t high = (uint32_t)(value >> 32), low = (uint32_t)value, rem;
+    uint32_t q_high = high / divisor;
+    rem = high % divisor;
+    uint32_t q_low;
+    asm("divl %4" : "=a"(q_low), "=d"(rem) : "a"(low), "d"(rem), "rm"(divisor));
+    return ((uint64_t)q_high << 32) | q_low;
+}
+
+// Measure the TSC against a 10 ms PIT wait. Timer setup calls this first.
+void clock_initialize();
+uint64_t clock_now_ns();
+uint64_t clock_ns_to_cycles(uint64_t ns);
+
+// The device is used when it rates higher than the current one
+void clockevent_register(clockevent_device_t *device);
+// Every device calls this from its interrupt
+void clockevent_interrupt();
+// Arm the device again after something else had its hardware
+void clockevent_resume();
+
+// 'event' is the caller's, it must stay put until it has run or been
+// cancelled. Adding a queued event moves it.
+void timer_event_add(timer_event_t *event, uint64_t expires_ns, timer_callback_t callback, void *data);
+void timer_event_cancel(timer_event_t *event);
+// Halt until the timer expires, other interrupts come and go meanwhile
+void timer_sleep_ns(uint64_t ns);
+
+// Halt until the next interrupt, whatever it is. Call with interrupts off
+// after checking there is nothing to do, returns with them on.
+void clockevent_idle();
+
+void clockevent_benchmark();
+void clockevent_print_stats();
+
+#endif // CLOCKEVENT_H
@@ -0,0 +1,33 @@
+#ifndef DEMAND_H
+#define DEMAND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ---------------------------------------------------------------------------
+// Demand-zero memory
+//
+// Reserving a region only claims virtual pages in the demand window. The
+// first read of a page maps the shared zero page read-only, the first write
+// gives it a private zeroed frame, so a large sparse buffer only costs the
+// frames of the pages that are written. The write protect bit in CR0 is what
+// makes kernel writes to the zero page fault.
+// ---------------------------------------------------------------------------
+#define DEMAND_WINDOW_BASE  0xE0000000
+#define DEMAND_WINDOW_PAGES 0x10000     // 256 MiB
+
+void demand_initialize();
+
+// Returns the start of the region, 0xFFFFFFFF when the window is full
+void *demand_reserve(size_t size);
+// Give back the region and every frame behind it
+void demand_release(void *ptr, size_t size);
+
+// Called by the page fault handler, true when the fault was a demand page
+// that is now mapped
+bool demand_fault(uint32_t fault_addr, uint32_t error);
+
+void demand_print_stats();
+
+#endif // DEMAND_H
@@ -0,0 +1,34 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ---------------------------------------------------------------------------
+// DMA zones
+//
+// Physically contiguous ranges set aside at boot, before the rest of memory
+// gets fragmented, for devices with addressing limits. Buffers are handed
+// out in whole pages and come back with both their virtual and physical
+// address, so drivers can program the device without a bounce copy.
+// ---------------------------------------------------------------------------
+#define DMA_ISA_LIMIT       0x1000000ULL     // ISA DMA reaches the low 16 MiB
+#define DMA_32_LIMIT        0x100000000ULL   // 32-bit bus masters
+#define DMA_ISA_ZONE_ORDER  8                // 1 MiB
+#define DMA_32_ZONE_ORDER   10               // 4 MiB
+#define DMA_MIN_ZONE_ORDER  4                // Settle for 64 KiB when memory is tight
+#define DMA_BOUNDARY        0x10000          // ISA controllers cannot cross 64 KiB
+
+// dma_alloc flags
+#define DMA_ZONE_ISA        0x01             // Below 16 MiB
+#define DMA_NO_64K_CROSS    0x02             // Must not straddle a 64 KiB boundary
+
+void dma_initialize();
+
+// Returns the virtual address (0xFFFFFFFF on failure) and stores the bus address in 'phys'
+void *dma_alloc(size_t size, uint32_t flags, uint32_t *phys);
+void dma_free(void *virt, size_t size);
+
+void dma_print_stats();
+
+#endif // DMA_H
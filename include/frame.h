@@ -0,0 +1,107 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "multiboot2.h"
+
+// ---------------------------------------------------------------------------
+// Definitions
+// ---------------------------------------------------------------------------
+#define FRAME_SIZE            4096
+#define FRAME_SHIFT           12
+#define FRAME_MAX_ORDER       10          // Largest block is 2^10 frames (4 MiB)
+#define FRAME_NONE            0xFFFFFFFF  // Returned when no frame is available
+#define FRAME_LOW_RESERVED    0x100000    // BIOS, VGA and real mode data live below 1 MiB
+#define FRAME_LIMIT           0x100000000ULL // Frames must be reachable with 32-bit addresses
+#define FRAME_DIRECT_LIMIT    0xC0000000ULL  // Frames are used through the identity map, which ends here
+#define FRAME_ZERO_POOL_SIZE  64          // Pages kept cleared ahead of time (256 KiB)
+#define FRAME_ZERO_BATCH      4           // Pages cleared per idle loop pass
+#define FRAME_MAX_COLORS      64          // Cache colors tracked at most (a 4 MiB way)
+#define FRAME_DEFAULT_COLORS  16          // When CPUID has no L2 description (512 KiB, 8-way)
+#define FRAME_COLOR_NEXT      0xFFFFFFFF  // frame_alloc_colored picks up where the last run ended
+
+// Frames past the identity map are only ever reached through a mapping made
+// for them, so their addresses may be wider than a pointer. With PAE that is
+// everything up to 64 GiB, without it the last GiB below 4 GiB.
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+typedef uint64_t phys_addr_t;
+#define FRAME_HIGH_LIMIT      0x1000000000ULL // 36 physical address bits, what every PAE CPU has
+#else
+typedef uint32_t phys_addr_t;
+#define FRAME_HIGH_LIMIT      FRAME_LIMIT
+#endif
+#define FRAME_HIGH_NONE       ((phys_addr_t)-1)
+
+// Per-frame bookkeeping, kept outside the frames so they can be handed out untouched
+typedef struct {
+    uint32_t next;  // Next free block of the same order (frame number)
+    uint32_t prev;  // Previous free block of the same order (frame number)
+    uint8_t  order; // Order of the block this frame heads
+    uint8_t  flags; // FRAME_FLAG_*
+    uint16_t reserved;
+} frame_info_t;
+
+#define FRAME_FLAG_FREE     0x01 // Frame heads a free block
+#define FRAME_FLAG_RESERVED 0x02 // Frame is never handed out (firmware, kernel, tables)
+
+// multiboot_mmap_entry_t names its halves backwards: addr_hi/len_hi are the
+// low dwords (they come first in memory) and addr_lo/len_lo the high dwords.
+static inline uint64_t mmap_entry_base(multiboot_mmap_entry_t *entry) {
+    return ((uint64_t)entry->addr_lo << 32) | entry->addr_hi;
+}
+
+static inline uint64_t mmap_entry_length(multiboot_mmap_entry_t *entry) {
+    return ((uint64_t)entry->len_lo << 32) | entry->len_hi;
+}
+
+// Build the allocator from the multiboot2 memory map
+void frame_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_t *mmap_tag);
+
+// Allocate/free 2^order physically contiguous, naturally aligned frames
+uint32_t frame_alloc(uint32_t order);
+uint32_t frame_alloc_below(uint32_t order, uint64_t limit);
+void frame_free(uint32_t phys_addr, uint32_t order);
+
+// Allocate/free exactly 'count' physically contiguous frames
+uint32_t frame_alloc_pages(uint32_t count);
+void frame_free_pages(uint32_t phys_addr, uint32_t count);
+
+static inline uint32_t frame_alloc_page() {
+    return frame_alloc(0);
+}
+
+static inline void frame_free_page(uint32_t phys_addr) {
+    frame_free(phys_addr, 0);
+}
+
+// Smallest order whose block holds 'size' bytes
+uint32_t frame_order_for(size_t size);
+
+uint32_t frame_free_count();
+uint32_t frame_total_count();
+uint32_t frame_span();                    // Frames from address 0 up to the highest usable one
+
+// Single pages that read as zero, cleared in advance by frame_zero_refill from the idle loop
+uint32_t frame_alloc_zeroed();
+uint32_t frame_zero_refill(uint32_t budget);
+void frame_zero_stats(uint32_t *hits, uint32_t *misses, uint32_t *pooled);
+
+// Frames of different color never share L2 sets. A run of 'count' frames
+// whose first frame has 'color', or FRAME_COLOR_NEXT to place it right after
+// the previous colored run in the cache. Free with frame_free_pages.
+uint32_t frame_alloc_colored(uint32_t count, uint32_t color);
+uint32_t frame_color_count();
+static inline uint32_t frame_color(uint32_t phys_addr) {
+    return (phys_addr >> FRAME_SHIFT) & (frame_color_count() - 1);
+}
+
+// Single frames above FRAME_DIRECT_LIMIT, for memory that is only used
+// through its own mapping. FRAME_HIGH_NONE once high memory is gone, callers
+// fall back to frame_alloc_page. frame_free_high takes either kind.
+phys_addr_t frame_alloc_high();
+void frame_free_high(phys_addr_t phys_addr);
+uint32_t frame_high_free_count();
+uint32_t frame_high_total_count();
+
+#endif // FRAME_H
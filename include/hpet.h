@@ -19,6 +19,12 @@
 #define HPET_TIMER_CONFIG            0x100
 #define HPET_TIMER_COMPARATOR        0x108
 #define HPET_ENABLE_BIT              0x1
+#define HPET_LEGACY_ROUTE            0x2         // Timer 0 on IRQ 0, timer 1 on IRQ 8
+#define HPET_LEGACY_ROUTE_CAPABLE    (1 << 15)   // In the capabilities
+#define HPET_TIMER_LEVEL             (1 << 1)
+#define HPET_TIMER_INT_ENABLE        (1 << 2)
+#define HPET_TIMER_PERIODIC          (1 << 3)
+#define HPET_TIMER_32BIT             (1 << 8)
 #define HPET_FREQ                    14318180
 #define HPET_TPS                     2500000
 
@@ -36,6 +42,8 @@ void HPET_ConfigureTimer(uint32_t timer_id, uint64_t period_ns);
 void HPET_IncrementValueAtInterval(uint32_t interval_ticks);
 void HPET_Sleep(float seconds);
 void HPET_SleepNS(uint32_t ns);
+// One-shot clock events from timer 0, for machines without a local APIC
+void HPET_ClockeventInitialize();
 
 
 // Read a 32-bit value from an HPET register (works for both memory-mapped and I/O mode)
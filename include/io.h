@@ -48,6 +48,56 @@
 #define CLI() asm ("cli")
 #define STI() asm ("sti")
 
+// Disable interrupts and return the previous EFLAGS, for short critical sections
+static inline uintptr_t irq_save() {
+    uintptr_t flags;
+    // Spelled out: the cli must stay put even where 'asm' is not the macro above
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uintptr_t flags) {
+    asm("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+// Time stamp counter, for cycle counts and cheap timestamps
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    // Two reads must stay two reads, in program order
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high) :: "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
+// Atomic add, returns the value before the add
+static inline uint32_t atomic_add(volatile uint32_t *value, uint32_t delta) {
+    asm("lock xaddl %0, %1" : "+r"(delta), "+m"(*value) :: "memory", "cc");
+    return delta;
+}
+
+static inline uint32_t atomic_xchg(volatile uint32_t *value, uint32_t new_value) {
+    asm("xchgl %0, %1" : "+r"(new_value), "+m"(*value) :: "memory");
+    return new_value;
+}
+
+// Compare and swap, on failure 'expected' is updated to the current value
+static inline bool atomic_cas(volatile uint32_t *value, uint32_t *expected, uint32_t new_value) {
+    bool swapped;
+    asm("lock cmpxchgl %3, %1; sete %0"
+        : "=q"(swapped), "+m"(*value), "+a"(*expected)
+        : "r"(new_value)
+        : "memory", "cc");
+    return swapped;
+}
+
+static inline bool atomic_cas64(volatile uint64_t *value, uint64_t *expected, uint64_t new_value) {
+    bool swapped;
+    asm("lock cmpxchg8b %1; sete %0"
+        : "=q"(swapped), "+m"(*value), "+A"(*expected)
+        : "b"((uint32_t)new_value), "c"((uint32_t)(new_value >> 32))
+        : "memory", "cc");
+    return swapped;
+}
+
 #define FLAG_SET(x, flag) x |= (flag)
 #define FLAG_UNSET(x, flag) x &= ~(flag)
 
@@ -76,6 +126,18 @@ static inline void outsw(uint16_t __port, const void *__buf, unsigned long __n)
 
 void iowait();
 
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+	asm("cpuid"
+			: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+			: "a"(leaf), "c"(subleaf));
+}
+
+// CPUID feature bits we care about
+#define CPUID_1_EDX_PSE     (1 << 3)
+#define CPUID_1_EDX_PGE     (1 << 13)
+#define CPUID_1_EDX_SSE2    (1 << 26)
+#define CPUID_7_EBX_ERMS    (1 << 9)
+
 void cpuSetMSR(uint32_t msr, uint32_t eax, uint32_t edx);
 void cpuGetMSR(uint32_t msr, uint32_t *eax, uint32_t *edx);
 uint8_t apic_enablable();
@@ -0,0 +1,69 @@
+#ifndef ISR_POOL_H
+#define ISR_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ---------------------------------------------------------------------------
+// Interrupt-safe pools
+//
+// Fixed-size objects set aside up front, for handlers that cannot call into
+// the heap. Free objects sit on lock-free stacks whose head carries a
+// generation count next to the top pointer, swapped together with
+// cmpxchg8b, so a handler that pops and pushes between another context's
+// read and swap cannot sneak a stale next pointer in. A vector can take a
+// reserve that only its own handler draws on once the shared objects run
+// out, so one busy device cannot starve the rest.
+// ---------------------------------------------------------------------------
+#define ISR_POOL_MAX_RESERVES  4
+#define ISR_POOL_ANY_VECTOR    0xFFFFFFFF   // Shared objects only, for thread context
+
+// Low half is the top object, high half the generation
+typedef struct {
+    volatile uint64_t head;
+} isr_stack_t;
+
+typedef struct {
+    uint32_t vector;
+    uint32_t count;
+    isr_stack_t free;
+} isr_reserve_t;
+
+typedef struct isr_pool {
+    const char *name;
+    uint32_t object_size;
+    uint32_t count;
+    uint8_t *objects;
+    uint8_t *owner;              // Per object, 0 for shared or the reserve index + 1
+
+    isr_stack_t free;
+    isr_reserve_t reserves[ISR_POOL_MAX_RESERVES];
+    uint32_t reserve_count;
+
+    volatile uint32_t in_use;
+    volatile uint32_t high_watermark;
+    volatile uint32_t reserve_allocs; // Served from a reserve after the shared objects ran out
+    volatile uint32_t failed;
+
+    struct isr_pool *next;       // All pools, for isr_pool_print_stats
+} isr_pool_t;
+
+// Buffers that interrupt handlers hand off to the rest of the kernel
+#define IRQ_BUFFER_SIZE        64
+#define IRQ_BUFFER_COUNT       128
+extern isr_pool_t *irq_buffer_pool;
+
+void isr_pool_initialize();
+
+// Create and reserve from thread context only. Returns NULL when out of memory.
+isr_pool_t *isr_pool_create(const char *name, size_t object_size, uint32_t count);
+bool isr_pool_reserve(isr_pool_t *pool, uint32_t vector, uint32_t count);
+
+// Safe from any context. Returns 0xFFFFFFFF when the pool is exhausted.
+void *isr_pool_alloc(isr_pool_t *pool, uint32_t vector);
+void isr_pool_free(isr_pool_t *pool, void *object);
+
+void isr_pool_print_stats();
+
+#endif // ISR_POOL_H
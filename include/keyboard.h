@@ -144,6 +144,17 @@ typedef struct {
     bool chars[128];
 } keyboard_t;
 
+// Key transitions queued by the interrupt handler, read back in arrival order
+typedef struct keyboard_event {
+    struct keyboard_event *next;
+    uint8_t scancode;
+    uint16_t mods;
+    char key_char;
+    bool pressed;
+} keyboard_event_t;
+
+#define KEYBOARD_EVENT_RESERVE 16 // IRQ buffers only the keyboard handler may use
+
 
 extern keyboard_t    keyboard; // Declare variable as extern
 extern const uint8_t keyboard_layout_us[2][128]; // Declare array as extern
@@ -176,6 +187,8 @@ uint8_t keyboard_reset();
 uint8_t keyboard_identify();
 
 void keyboard_handler(Registers *regs);
+bool keyboard_read_event(keyboard_event_t *event);
+bool keyboard_has_event();
 void keyboard_pic_init();
 void keyboard_apic_init();
 void IOAPIC_ConfigureKeyboard();
@@ -10,9 +10,18 @@ extern uint32_t total_mem;
 extern uint32_t heap_start;
 extern uint32_t heap_end;
 
+// Copies of the ACPI reclaimable mmap entries, kept in the boot arena
+extern multiboot_mmap_entry_t *acpi_reclaim_entries;
+extern uint32_t acpi_reclaim_count;
+
 extern uint32_t _cstart;
 extern uint32_t _end;
 
+// The kernel image is linked into the higher half and loaded this far below
+// its link address, see linker.ld and grub_entry.asm
+#define KERNEL_VIRT_BASE 0xC0000000
+#define KERNEL_PHYS(_x)  ((uint32_t)(_x) - KERNEL_VIRT_BASE)
+
 typedef struct {
     uint32_t eax_reg;
     multiboot_info_t* ebx_reg;
@@ -21,19 +30,96 @@ typedef struct {
 
 extern multiboot_data_t multiboot_data;
 
+// Heap size classes: exact bins every 16 bytes up to 256, then one bin per
+// power of two up to 8 KiB, everything bigger shares the large bin
+#define HEAP_ALIGN      16
+#define HEAP_MIN_BLOCK  16
+#define HEAP_EXACT_MAX  256                       // Bins up to here hold one exact size
+#define HEAP_EXACT_BINS (HEAP_EXACT_MAX / HEAP_ALIGN)
+#define HEAP_LARGE_MIN  8192                      // Blocks this big go to the large bin
+#define HEAP_LARGE_BIN  (HEAP_EXACT_BINS + 5)
+#define HEAP_NUM_BINS   (HEAP_LARGE_BIN + 1)
+#define HEAP_PAGE_MIN   (32 * 1024)               // Requests this big get whole pages of their own
+
+// Virtual window for page-backed allocations while paging is on
+#define HEAP_WINDOW_BASE  0xD0000000
+#define HEAP_WINDOW_PAGES 0x10000                 // 256 MiB
+
+// block_header_t.is_free beyond plain used (0) / free (1)
+#define HEAP_BLOCK_FRAMES 2                       // Page-backed, contiguous frames used through the identity map
+#define HEAP_BLOCK_MAPPED 3                       // Page-backed, pages mapped into the heap window
+#define HEAP_BLOCK_DEMAND 4                       // Page-backed and zeroed, demand-zero pages only backed once touched
+
+// Subsystem an allocation is charged to in the heap statistics
+typedef enum {
+    MEM_TAG_NONE = 0,
+    MEM_TAG_KERNEL,
+    MEM_TAG_COUNT
+} mem_tag_t;
+
+// Snapshot of the heap, see memory_get_stats
+typedef struct {
+    uint32_t heap_bytes;      // Bytes handed to the heap by the frame allocator
+    uint32_t used_bytes;      // Payload bytes in allocated blocks
+    uint32_t used_blocks;
+    uint32_t free_bytes;      // Payload bytes sitting in the bins
+    uint32_t free_blocks;
+    uint32_t largest_free;    // Biggest single free payload
+    uint32_t alloc_count;     // Successful allocations since boot
+    uint32_t free_count;
+    uint32_t failed_count;    // Allocations that could not be served
+    uint32_t page_bytes;      // Bytes of whole pages behind page-backed blocks
+    uint32_t page_blocks;
+    uint32_t bin_blocks[HEAP_NUM_BINS];      // Free blocks waiting in each bin
+    uint32_t alloc_histogram[HEAP_NUM_BINS]; // Requests served, by size class of the request
+    uint32_t tag_bytes[MEM_TAG_COUNT];
+    uint32_t tag_blocks[MEM_TAG_COUNT];
+} mem_stats_t;
+
+// Allocation trace, see memory_trace_start
+#define MEM_TRACE_ORDER 5                         // Ring of 2^5 frames, 6553 events
+#define MEM_TRACE_PORT  0xE9                      // Dumps are mirrored to the QEMU/Bochs debug console
+
+typedef enum {
+    MEM_TRACE_ALLOC   = 'a',
+    MEM_TRACE_CALLOC  = 'c',
+    MEM_TRACE_ALIGNED = 'l',
+    MEM_TRACE_REALLOC = 'r',
+    MEM_TRACE_FREE    = 'f'
+} mem_trace_op_t;
+
+typedef struct {
+    uint32_t timestamp;       // Low half of the TSC
+    uint32_t size;            // Requested size, 0 for frees
+    uint32_t ptr;             // Block returned (0xFFFFFFFF if the call failed) or freed
+    uint32_t arg;             // Old block for reallocs, alignment for aligned allocations
+    uint8_t op;               // mem_trace_op_t
+    uint8_t tag;
+    uint16_t reserved;
+} mem_trace_event_t;
+
 // Simple memory region structure for heap management
+// The header is 16 bytes so payloads keep the 16 byte alignment of the block
 typedef struct block_header {
-    uint32_t size;            // Size of the block, 4 bytes
+    uint32_t size;            // Size of the payload, multiple of 16, 4 bytes
+    uint32_t prev_size;       // Boundary tag: payload size of the block physically before, 0 if first, 4 bytes
     uint32_t is_free;         // Wether it is free or used, 4 bytes
-    uint32_t reserved;        // Align 8
-    struct block_header *next; // Pointer to the next block in the free list, 4 bytes
+    uint32_t tag;             // mem_tag_t of the owner while allocated, 4 bytes
 } __attribute__((packed)) block_header_t;
 
+// Free blocks link into their size-class bin through the start of the payload
+typedef struct free_block {
+    block_header_t header;
+    struct free_block *next;  // Next free block in the same bin
+    struct free_block *prev;  // Previous free block in the same bin
+} __attribute__((packed)) free_block_t;
+
 // Function to initialize memory
 void memory_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_t *mmap_tag);
 
 // Memory allocation functions
 void *memalloc(size_t size);
+void *memalloc_tagged(size_t size, mem_tag_t tag);
 void memfree(void *ptr);
 
 // Utility functions
@@ -41,6 +127,9 @@ void *memset(void *ptr, int value, size_t num);
 void *memcpy(void *dest, const void *src, size_t n);
 int8_t memcmp(const char *str1, const char *str2, size_t n);
 void *memmove(void *dst, const void *src, size_t n);
+// rep stosd only, for the page fault path. The ISR stubs do not save the SSE
+// registers, and a fault can land in the middle of an SSE copy.
+void *memset_nosse(void *ptr, int value, size_t num);
 
 void *memrealloc(void *ptr, size_t new_size);
 void *memcalloc(size_t num, size_t size);
@@ -49,7 +138,21 @@ void *mem_alloc_aligned(size_t size, size_t alignment);
 // Function to calculate total system memory
 uint32_t get_total_memory();
 
+// Heap introspection
+void memory_get_stats(mem_stats_t *stats);
+void memory_print_stats();
+
+// Record allocator calls into a ring buffer, returns 0 if the ring cannot be set up
+uint8_t memory_trace_start();
+void memory_trace_stop();
+void memory_trace_dump();
+
 
 void *memset_pattern(void *ptr, const void *pattern, size_t pattern_size, size_t num);
+void *memset_pattern_stream(void *ptr, const void *pattern, size_t pattern_size, size_t num);
+
+// Pick the memcpy/memset routines for this CPU, and check/time all of them
+void memory_select_ops();
+void memory_benchmark();
 
 #endif // MEMORY_H
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include "io.h"
 #include "util.h"
+#include "pat.h"
+#include "frame.h"
 
 // ---------------------------------------------------------------------------
 // Definitions
@@ -26,8 +28,81 @@
 // For uncached mappings (e.g. ioremap_nocache), include PWT | PCD.
 #define PAGING_UNCACHED_FLAGS  (PAGING_PAGE_PRESENT | PAGING_PAGE_RW | PAGING_PAGE_PWT | PAGING_PAGE_PCD)
 
-// Range to identity map (for example, map the first 16 MB)
-#define PAGING_IDENTITY_MAP_SIZE   (16 * 1024 * 1024)
+#define PAGING_NO_MAPPING      ((phys_addr_t)-1) // virt_to_phys result for unmapped addresses
+
+// With __PHYSICAL_MEMORY_EXTENSION__ the kernel is built for PAE paging:
+// entries are 64 bits wide, so they reach 64 GiB and carry the NX bit, and a
+// table only holds 512 of them. Four directories sit back to back behind a
+// four entry page directory pointer table, which lets page_directory be
+// indexed by virt >> PAGING_DIR_SHIFT in both modes.
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+typedef uint64_t pte_t;
+#define PAGING_DIR_SHIFT       21
+#define PAGING_TABLE_ENTRIES   512
+#define PAGING_DIR_ENTRIES     2048
+#define PAGING_LARGE_PAGE_SIZE 0x200000   // One page directory entry, PS set
+#define PAGING_FRAME_MASK      0x000FFFFFFFFFF000ULL
+#define PAGING_PTE_NX          0x8000000000000000ULL
+#define PAGING_PDPT_ENTRIES    4
+#else
+typedef uint32_t pte_t;
+#define PAGING_DIR_SHIFT       22
+#define PAGING_TABLE_ENTRIES   1024
+#define PAGING_DIR_ENTRIES     1024
+#define PAGING_LARGE_PAGE_SIZE 0x400000   // One page directory entry with PSE
+#define PAGING_FRAME_MASK      0xFFFFF000
+#define PAGING_PTE_NX          0          // No room for it in a 32-bit entry
+#endif
+#define PAGING_LARGE_FRAME_MASK (PAGING_FRAME_MASK & ~(pte_t)(PAGING_LARGE_PAGE_SIZE - 1))
+
+#define PAGING_CR4_PSE         0x10
+#define PAGING_CR4_PAE         0x20
+#define PAGING_CR4_PGE         0x80
+#define PAGING_CR0_WP          0x10000    // Kernel writes honour read-only pages too
+
+// Page fault error code bits
+#define PAGING_FAULT_PRESENT   0x01       // Protection violation, not a missing page
+#define PAGING_FAULT_WRITE     0x02
+#define PAGING_FAULT_USER      0x04
+#define PAGING_FAULT_RESERVED  0x08       // A reserved bit was set in some entry
+#define PAGING_FAULT_FETCH     0x10       // Instruction fetch, only reported with NX
+
+// Fault latency histogram, bucket 'i' counts faults under 2^(PAGING_FAULT_MIN_SHIFT + i)
+// cycles, the last one everything slower
+#define PAGING_FAULT_BUCKETS   10
+#define PAGING_FAULT_MIN_SHIFT 9
+#define PAGING_FAULT_TOP       8          // Pages tracked as the most faulted
+
+// The last directory entries point at the directories themselves, so every
+// page table shows up at the top of the address space: the table behind
+// directory entry 'i' at PAGING_TABLE(i), and the entry for any page at
+// PAGING_PTE(virt). That takes one entry and 4 MiB, or four and 8 MiB with PAE.
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+#define PAGING_RECURSIVE_SLOT  2044
+#define PAGING_TABLES_BASE     0xFF800000
+#else
+#define PAGING_RECURSIVE_SLOT  1023
+#define PAGING_TABLES_BASE     0xFFC00000
+#endif
+#define PAGING_TABLE(_i)       ((pte_t *)(PAGING_TABLES_BASE + ((_i) << 12)))
+#define PAGING_PTE(_virt)      (((pte_t *)PAGING_TABLES_BASE)[(uint32_t)(_virt) >> 12])
+
+// The directory entry below them holds temporary mappings of single frames
+#define PAGING_FIXMAP_SLOT     (PAGING_RECURSIVE_SLOT - 1)
+#define PAGING_FIXMAP_BASE     ((uint32_t)PAGING_FIXMAP_SLOT << PAGING_DIR_SHIFT)
+
+// paging_benchmark maps this many pages right after the first fixmap page
+#define PAGING_BENCH_PAGES     64
+#define PAGING_BENCH_ROUNDS    64
+
+// Where the PAT bit really sits, PAGE_PAT is placed in one of these
+#define PAGING_PTE_PAT         0x080      // Bit 7 of a 4 KiB page's entry
+#define PAGING_PDE_PAT         0x1000     // Bit 12 of a large page's entry
+
+// No-execute needs EFER.NXE, otherwise bit 63 is reserved
+#define PAGING_EFER_MSR        0xC0000080
+#define PAGING_EFER_NXE        0x800
+#define CPUID_80000001_EDX_NX  (1 << 20)
 
 
 
@@ -59,7 +134,7 @@ typedef enum {
     PAGE_DIRTY           = 0x040,
     PAGE_4MB             = 0x080,
     PAGE_GLOBAL          = 0x100,
-    PAGE_PAT             = 0x200,
+    PAGE_PAT             = 0x200, // Logical, moved to PAGING_PTE_PAT or PAGING_PDE_PAT when the entry is written
     PAGE_PROTECTED_KEY   = 0x400, // Protection key
     PAGE_EXECUTE_DISABLE = 0x800,  // Execute Disable
     PAGE_FRAME           = 0xFFFFF000,
@@ -69,6 +144,7 @@ typedef enum {
     PAGE_SYSRODATA       = (PAGE_PRESENT | PAGE_EXECUTE_DISABLE),
     PAGE_DEFAULT         = (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER),
     PAGE_SYSDEFAULT      = (PAGE_PRESENT | PAGE_WRITABLE),
+    PAGE_SYSGLOBAL       = (PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL), // Kernel only, the same in every address space
     PAGE_UNCACHED        = (PAGE_PRESENT | PAGE_WRITABLE | PAGE_PWT | PAGE_PCD),
 } PageProperty;
 
@@ -100,23 +176,44 @@ extern uint32_t _end;
 // extern uint32_t page_directory;
 
 static inline void load_cr3(uint32_t pd_phys_addr) {
-    asm("mov %0, %%cr3" : : "r"(pd_phys_addr));
+    asm("mov %0, %%cr3" : : "r"(pd_phys_addr) : "memory");
 }
 
-static inline void enable_paging(uint32_t *page_directory) {
-    asm("mov %0, %%cr3" : : "r" (page_directory));
+// Filled in by the boot stub, CR3 points at the pointer table with PAE and
+// at the directory without
+extern pte_t page_directory[PAGING_DIR_ENTRIES];
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+extern uint64_t page_dir_pointers[PAGING_PDPT_ENTRIES];
+#define PAGING_ROOT            KERNEL_PHYS(page_dir_pointers)
+#else
+#define PAGING_ROOT            KERNEL_PHYS(page_directory)
+#endif
 
-    // Enable paging by setting PG and PE bits in CR0
-    uint32_t cr0;
-    asm("mov %%cr0, %0" : "=r" (cr0));
-    cr0 |= 0x80000001;
-    asm("mov %0, %%cr0" : : "r" (cr0));
-}
+// Paging is on from the boot stub, this is set once paging_init has cut the
+// boot identity map down to real memory
+extern uint8_t paging_active;
 
 void flush_tlb_range(uint32_t start, uint32_t end);
 void paging_init();
-void set_page_mapping(uint32_t virt_addr, uint32_t phys_addr, PageProperty flags);
+void set_page_mapping(uint32_t virt_addr, phys_addr_t phys_addr, PageProperty flags);
+
+// Map a whole range, with large pages wherever both sides are aligned, 4 KiB
+// pages elsewhere. Works before paging_init too, for devices that set up
+// their registers early.
+void paging_map_range(uint32_t virt_addr, phys_addr_t phys_addr, uint32_t size, PageProperty flags);
+phys_addr_t virt_to_phys(uint32_t virt_addr);
+
+// The entry mapping 'virt_addr', the directory entry itself for large pages
+pte_t paging_get_entry(uint32_t virt_addr);
+// Clear the entry for 'virt_addr' and return what it held, 0 if nothing.
+// The TLB is left alone, flush it or go through a tlb_gather_t.
+pte_t paging_clear_entry(uint32_t virt_addr);
+
+// Cycles to touch a page right after a CR3 reload, with global and non-global mappings
+void paging_benchmark();
 void unmap_page(void* virtualaddr);
+// Fault counts by cause, latency and the most faulted pages
+void paging_print_stats();
 
 
 #endif // PAGING_H
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef PAT_H
+#define PAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ---------------------------------------------------------------------------
+// Memory types
+//
+// The page attribute table lets each mapping pick its own memory type
+// through the PWT, PCD and PAT bits of the entry. The power-on table has
+// write-back in slot 4 as well as slot 0, so slot 4 (PAT set, PCD and PWT
+// clear) is repurposed for write-combining and the other slots keep their
+// defaults, which keeps every entry written without the PAT bit meaning
+// what it always did. On CPUs without PAT a write-combining range falls
+// back to a variable MTRR covering it, with the pages left write-back.
+// ---------------------------------------------------------------------------
+#define IA32_PAT_MSR              0x277
+#define IA32_MTRRCAP_MSR          0xFE
+#define IA32_MTRR_DEF_TYPE_MSR    0x2FF
+#define IA32_MTRR_PHYSBASE_MSR(n) (0x200 + 2 * (n))
+#define IA32_MTRR_PHYSMASK_MSR(n) (0x201 + 2 * (n))
+
+#define MTRRCAP_VCNT_MASK         0xFF
+#define MTRRCAP_WC                (1 << 10)
+#define MTRR_DEF_TYPE_ENABLE      (1 << 11)
+#define MTRR_PHYSMASK_VALID       (1 << 11)
+
+#define CPUID_1_EDX_MTRR          (1 << 12)
+#define CPUID_1_EDX_PAT           (1 << 16)
+
+// Encodings shared by PAT slots and MTRRs
+typedef enum {
+    CACHE_UC       = 0x00, // Uncached
+    CACHE_WC       = 0x01, // Write-combining, for framebuffers
+    CACHE_WT       = 0x04, // Write-through
+    CACHE_WP       = 0x05, // Write-protected
+    CACHE_WB       = 0x06, // Write-back, ordinary memory
+    CACHE_UC_MINUS = 0x07, // Uncached, but an MTRR can still make it WC
+} cache_type_t;
+
+// Slot 4 is WC, the rest as at power-on
+#define PAT_VALUE_LOW   (CACHE_WB | (CACHE_WT << 8) | (CACHE_UC_MINUS << 16) | (CACHE_UC << 24))
+#define PAT_VALUE_HIGH  (CACHE_WC | (CACHE_WT << 8) | (CACHE_UC_MINUS << 16) | (CACHE_UC << 24))
+
+// Call before the first mapping that asks for write-combining
+void pat_initialize();
+bool pat_enabled();
+
+// PWT/PCD/PAGE_PAT bits selecting 'type' in an entry, with PAGE_PAT as the
+// logical flag that paging places in the right bit for the entry size.
+// Types the table cannot express come back as uncached.
+uint32_t pat_page_flags(cache_type_t type);
+
+// Cover [base, base + size) with variable MTRRs of 'type'. The range is split
+// into naturally aligned power of two pieces, one MTRR each, and false comes
+// back when there are not enough free MTRRs (nothing is changed then).
+bool mtrr_set_range(uint64_t base, uint64_t size, cache_type_t type);
+
+void pat_print_info();
+
+#endif // PAT_H
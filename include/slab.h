@@ -0,0 +1,75 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ---------------------------------------------------------------------------
+// Object caches
+//
+// Fixed-size objects are carved out of slabs, naturally aligned runs of page
+// frames with a slab_t header at the start, so an object finds its slab by
+// masking its address. Each CPU fronts the cache with a magazine, a small
+// stack of free objects, so alloc/free pairs stay off the slab lists.
+// ---------------------------------------------------------------------------
+#define SLAB_MAX_CPUS       1     // Single processor for now, magazines are indexed by slab_cpu()
+#define SLAB_MAGAZINE_SIZE  16
+#define SLAB_MAX_ORDER      3     // Slabs are at most 32 KiB
+#define SLAB_MIN_OBJECTS    8     // Grow the slab order until this many objects fit
+#define SLAB_CACHE_LINE     64    // Alignment that keeps objects on their own cache lines
+
+// The free objects are a stack of indexes behind the header, so the objects
+// themselves keep their constructed state while free
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct slab_cache *cache;
+    uint16_t in_use;
+    uint16_t free_top;           // Entries on the free_index stack
+    uint16_t free_index[];
+} slab_t;
+
+typedef struct {
+    uint32_t count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct slab_cache {
+    const char *name;
+    uint32_t object_size;        // Size with alignment padding
+    uint32_t align;
+    uint32_t order;              // Frame order of every slab
+    uint32_t first_offset;       // Offset of the first object in a slab
+    uint16_t per_slab;
+    void (*ctor)(void *object);  // Run once per object when its slab is created
+
+    slab_t *partial;             // Slabs with some free objects
+    slab_t *full;
+    slab_t *empty;               // At most one kept around for quick reuse
+
+    slab_magazine_t magazines[SLAB_MAX_CPUS];
+
+    uint32_t slab_count;
+    uint32_t objects_in_use;     // Currently held by callers
+    uint32_t magazine_hits;
+    uint32_t magazine_misses;
+
+    struct slab_cache *next;     // All caches, for slab_print_stats
+} slab_cache_t;
+
+// Objects come back from slab_alloc in the state 'ctor' left them in, and must
+// be handed to slab_free in that same state. An 'align' of 0, or one that is
+// not a power of two of at least a pointer, means SLAB_CACHE_LINE. Returns
+// NULL if the size does not fit a slab.
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *object));
+void slab_cache_destroy(slab_cache_t *cache);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+
+// Give cached empty slabs and magazine contents back to the frame allocator
+void slab_cache_shrink(slab_cache_t *cache);
+
+void slab_print_stats();
+
+#endif // SLAB_H
@@ -13,15 +13,14 @@ void pit_prepare_sleep(uint32_t microseconds);
 uint16_t pit_read_counter();
 void pit_perform_sleep();
 
-// Timer Init functions
+// Timer Init functions, they calibrate the clock and register the best
+// one-shot clock event device there is (see clockevent.h)
 void timer_apic_init();
 void timer_pic_init();
 
 // Timer interrupt handler
 void timer_handler(Registers* regs);
 
-extern uint32_t timer_ticks;
-extern uint32_t timer_frequency;
-extern uint32_t timer_divisor;
+extern uint32_t timer_ticks;            // Timer interrupts taken, there is no fixed tick
 
 #endif // TIMER_H
\ No newline at end of file
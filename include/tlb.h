@@ -0,0 +1,50 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "paging.h"
+
+// ---------------------------------------------------------------------------
+// Batched TLB invalidation
+//
+// A gather collects unmaps and remaps and invalidates them in one go when it
+// is flushed: one invlpg per page for small ranges, and past
+// TLB_FLUSH_CEILING a single full flush, which costs about as much as that
+// many invlpgs and leaves the rest of the TLB to refill on demand. Frames
+// that were mapped are only freed once the flush is done, so nothing can
+// write through a stale entry into a frame that has a new owner. With more
+// than one CPU online the flush also goes to the others as one shootdown IPI
+// per gather instead of one per page.
+// ---------------------------------------------------------------------------
+#define TLB_FLUSH_CEILING     33      // Pages up to which invlpg beats a full flush, see paging_benchmark
+#define TLB_GATHER_FRAMES     64      // Frames held back per gather, it flushes itself when full
+#define TLB_SHOOTDOWN_VECTOR  0xFD
+
+typedef struct {
+    uint32_t start;                   // Virtual range with stale entries, start == end when none
+    uint32_t end;
+    uint8_t global;                   // A global entry went stale, a CR3 reload is not enough
+    phys_addr_t frames[TLB_GATHER_FRAMES];
+    uint32_t frame_count;
+} tlb_gather_t;
+
+// CPUs that need to hear about kernel mapping changes, bumped by AP startup
+extern volatile uint32_t tlb_cpus_online;
+
+void tlb_initialize();
+
+void tlb_gather_init(tlb_gather_t *gather);
+// Unmap 'virt' and, with 'free_frame', free the frame behind it after the flush
+void tlb_gather_unmap(tlb_gather_t *gather, uint32_t virt, bool free_frame);
+// Point 'virt' somewhere else, the old translation stays usable until the flush
+void tlb_gather_map(tlb_gather_t *gather, uint32_t virt, phys_addr_t phys, PageProperty flags);
+void tlb_gather_flush(tlb_gather_t *gather);
+
+// Invalidate everything, global entries too with 'global'
+void tlb_flush_all(bool global);
+
+void tlb_print_stats();
+
+#endif // TLB_H
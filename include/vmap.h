@@ -0,0 +1,62 @@
+#ifndef VMAP_H
+#define VMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "pat.h"
+#include "paging.h"
+
+// ---------------------------------------------------------------------------
+// Kernel virtual areas
+//
+// The window between the demand-zero window and the fixmap is handed out
+// in page-granular areas for device registers (ioremap) and for large
+// buffers that only need to be virtually contiguous (vmalloc). The window is
+// kept as one address-sorted list of free and used areas, so allocation is a
+// first fit walk and freeing merges with the neighbours. Every area is
+// followed by an unmapped guard page, so running off the end faults instead
+// of landing in the next area.
+//
+// Device mappings are shared: mapping a physical range that an existing
+// mapping of the same memory type already covers hands out that mapping
+// again and counts one more user, so drivers asking twice for the same BAR
+// do not eat window space or page table entries.
+// ---------------------------------------------------------------------------
+#define VMAP_BASE       0xF0000000
+#define VMAP_END        PAGING_FIXMAP_BASE
+#define VMAP_MAX_AREAS  128
+
+typedef enum {
+    VMAP_FREE,
+    VMAP_IOREMAP,
+    VMAP_VMALLOC,
+} vmap_kind_t;
+
+typedef struct vmap_area {
+    uint32_t start;
+    uint32_t size;              // Bytes, guard page included
+    vmap_kind_t kind;
+    uint32_t phys;              // ioremap: physical address at 'start'
+    cache_type_t type;          // ioremap: memory type of the mapping
+    uint32_t users;             // ioremap: callers sharing the mapping
+    struct vmap_area *next;     // Next area up in the window, or the next spare node
+} vmap_area_t;
+
+void vmap_initialize();
+
+// Map device memory [phys_addr, phys_addr + size) with the given memory type
+// and return its virtual address, 0xFFFFFFFF when the window is full.
+// Write-combining falls back to an MTRR when there is no PAT.
+void *ioremap_cache(uint32_t phys_addr, size_t size, cache_type_t type);
+void *ioremap_nocache(uint32_t phys_addr, size_t size);
+void iounmap(void *virt);
+
+// Virtually contiguous memory from any frames, high memory first. Returns
+// 0xFFFFFFFF on failure.
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+
+void vmap_print_stats();
+
+#endif // VMAP_H
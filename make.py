@@ -16,6 +16,11 @@ ASM = 'nasm'
 # Compiler flags
 CFLAGS = ['-ffreestanding', '-m32', '-O2', '-g', '-I', '/home/freedomuser/shared_folder/include']  # Now a list of separate flags
 ASFLAGS = '-O2 -f elf32'
+
+# PAE=1 builds for PAE paging, which reaches memory above 4 GiB
+if os.environ.get('PAE') == '1':
+    CFLAGS.append('-D__PHYSICAL_MEMORY_EXTENSION__')
+    ASFLAGS += ' -D__PHYSICAL_MEMORY_EXTENSION__'
 LDFLAGS = '-T/home/freedomuser/shared_folder/linker.ld -O2'
 
 # Source files
@@ -54,8 +59,9 @@ def get_sources() -> tuple[list[str], list[str]]:
     asm_files = []
     c_files = []
     for root, dirs, files in os.walk(SRC_DIR):
-        # Modify dirs in-place to skip any directory that starts with a dot
-        dirs[:] = [d for d in dirs if not d.startswith('.')]
+        # Modify dirs in-place to skip any directory that starts with a dot,
+        # and the host-side tools which are not part of the kernel
+        dirs[:] = [d for d in dirs if not d.startswith('.') and d != 'tools']
         for file in files:
             if file.endswith('.asm'):
                 asm_files.append(os.path.abspath(os.path.join(root, file)))
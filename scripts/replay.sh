@@ -0,0 +1,9 @@
+#!/bin/bash
+# Build the allocator replay harness for the host and run it on a trace,
+# e.g. one captured with "-debugcon file:memtrace.log" and the memdump command
+# usage: replay.sh trace.log [passes] [heap MiB]
+cd "$(dirname "$0")/.."
+mkdir -p bin
+# 32-bit like the kernel, so pointers and the allocator's uint32_t addresses agree
+gcc -m32 -O2 -g -fno-builtin -no-pie -iquote include tools/replay/replay.c -o bin/replay || exit 1
+./bin/replay "$@"
@@ -1 +1 @@
-qemu-system-i386 -cdrom /home/freedomuser/shared_folder/bin/doom_os.iso -m 64 -boot d -M q35
\ No newline at end of file
+qemu-system-i386 -cdrom /home/freedomuser/shared_folder/bin/doom_os.iso -m ${MEMORY:-64} -boot d -M q35 -debugcon file:memtrace.log
\ No newline at end of file
@@ -6,7 +6,16 @@
 #include "keyboard.h"
 #include "terminal.h"
 #include "memory.h"
+#include "frame.h"
+#include "slab.h"
+#include "isr_pool.h"
+#include "pat.h"
+#include "paging.h"
+#include "tlb.h"
+#include "demand.h"
+#include "vmap.h"
 #include "timer.h"
+#include "clockevent.h"
 #include "sound.h"
 #include "atapi.h"
 #include "util.h"
@@ -90,7 +99,7 @@ void kernel_main() {
     printf("ISO Signature: %x-%x-%x-%x-%x\n\n", 
         read_buffer[1], read_buffer[2], read_buffer[3], read_buffer[4], read_buffer[5]);
     printf("Memory: %u MB (%u MiB)\n", (uint32_t)(get_total_memory()/(1000*1000)), (uint32_t)(get_total_memory()/(1024*1024)));
-    volatile char *command_memory = (volatile char *)memalloc(512);
+    volatile char *command_memory = (volatile char *)memalloc_tagged(512, MEM_TAG_KERNEL);
     printf("Command Address: 0x%x\n\n", command_memory);
     uint16_t letter_index = 0;
     
@@ -106,47 +115,79 @@ void kernel_main() {
         // RenderStuff( (uint32_t)(hpet_tick_current - hpet_tick_old) ); // send
         // printf("One Second Has Passed!! 0x%x \n", hpet_tick_current - hpet_tick_old);
         hpet_tick_old = hpet_tick_current; // now the current tick count became old
-        HPET_Sleep(0.0001);                // Anti NUKE
-
-        for (char char_index=32; char_index<127; ++char_index) {
-            if (keyboard.chars[char_index]) {
-                printf("%c", char_index);
-                command_memory[letter_index] = char_index;
-                command_memory[letter_index+1] = 0;
-                ++letter_index;
-
-                keyboard.chars[char_index] = false;
-            }
+        // Idle time goes to clearing pages ahead. Once that is done the CPU
+        // halts until an interrupt, and with no periodic tick only a key or
+        // a timer that is actually due wakes it. The check runs with
+        // interrupts off so a key that comes in after it still ends the halt.
+        uint32_t cleared = frame_zero_refill(FRAME_ZERO_BATCH);
+        CLI();
+        if (cleared == 0 && !keyboard_has_event()) {
+            clockevent_idle();
+        } else {
+            STI();
         }
-        if (keyboard.chars['\n']) {
-            printf("\n");
-            printf("Executing Command: %s\n", command_memory);
 
-            keyboard.chars['\n'] = false;
-
-            letter_index = 0;
-            terminal_writestring("root@recoverymedia: /media/cdrom/$ ");
-        }
-        if (keyboard.chars['\b'] && letter_index==0) {
-            keyboard.chars['\b'] = false;
-        } else if (keyboard.chars['\b']) {
-            keyboard.chars['\b'] = false;
-            command_memory[letter_index-1] = 0;
-            if (terminal_column > 0) {
-                --terminal_column;
-            } else {
-                --terminal_row;
-                terminal_column = VGA_WIDTH-1;
+        keyboard_event_t event;
+        while (keyboard_read_event(&event)) {
+            char key = event.key_char;
+            if (!event.pressed) {
+                continue;
             }
-            printf(" ");            
-            if (terminal_column > 0) {
-                --terminal_column;
-            } else {
-                --terminal_row;
-                terminal_column = VGA_WIDTH-1;
+            if (key >= 32 && key < 127) {
+                printf("%c", key);
+                command_memory[letter_index] = key;
+                command_memory[letter_index+1] = 0;
+                ++letter_index;
+            } else if (key == '\n') {
+                printf("\n");
+                printf("Executing Command: %s\n", command_memory);
+                if (strncmp((const char *)command_memory, "meminfo", 8) == 0) {
+                    memory_print_stats();
+                    slab_print_stats();
+                    isr_pool_print_stats();
+                    pat_print_info();
+                    tlb_print_stats();
+                    demand_print_stats();
+                    vmap_print_stats();
+                } else if (strncmp((const char *)command_memory, "membench", 9) == 0) {
+                    memory_benchmark();
+                } else if (strncmp((const char *)command_memory, "tlbbench", 9) == 0) {
+                    paging_benchmark();
+                } else if (strncmp((const char *)command_memory, "faultinfo", 10) == 0) {
+                    paging_print_stats();
+                    tlb_print_stats();
+                } else if (strncmp((const char *)command_memory, "timerinfo", 10) == 0) {
+                    clockevent_print_stats();
+                } else if (strncmp((const char *)command_memory, "timerbench", 11) == 0) {
+                    clockevent_benchmark();
+                } else if (strncmp((const char *)command_memory, "memtrace", 9) == 0) {
+                    printf(memory_trace_start() ? "Tracing allocations\n" : "No room for the trace\n");
+                } else if (strncmp((const char *)command_memory, "memdump", 8) == 0) {
+                    memory_trace_stop();
+                    memory_trace_dump();
+                }
+                command_memory[0] = 0;
+
+                letter_index = 0;
+                terminal_writestring("root@recoverymedia: /media/cdrom/$ ");
+            } else if (key == '\b' && letter_index != 0) {
+                command_memory[letter_index-1] = 0;
+                if (terminal_column > 0) {
+                    --terminal_column;
+                } else {
+                    --terminal_row;
+                    terminal_column = VGA_WIDTH-1;
+                }
+                printf(" ");            
+                if (terminal_column > 0) {
+                    --terminal_column;
+                } else {
+                    --terminal_row;
+                    terminal_column = VGA_WIDTH-1;
+                }
+
+                --letter_index;
             }
-
-            --letter_index;
         }
         
         terminal_set_cursor_position(make_uint8_vector2(terminal_column, terminal_row));
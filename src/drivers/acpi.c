@@ -1,6 +1,7 @@
 #include "acpi.h"
 #include "terminal.h"
 #include "memory.h"
+#include "arena.h"
 #include "idt.h"
 #include "isr.h"
 #include "pic_irq.h"
@@ -10,6 +11,7 @@
 #include "util.h"
 #include "timer.h"
 #include "io.h"
+#include "vmap.h"
 
 #define IOAPIC_IRQ9_ENTRY       0x22
 #define IOAPIC_IRQ9_VECTOR      0x29
@@ -85,6 +87,8 @@ uint8_t  acpi_rval;
 uint8_t *S4BIOS_REQ;
 
 mcfg_allocation_t *PCIe_data;
+uint32_t PCIe_count = 0;
+static uint8_t ***pcie_bus_maps;    // Per MCFG entry, the mapping of each of its buses or NULL
 hpet_table_t      *hpet_data;
 madt_table_t      *apic_data;
 acpi_header_t     *rsdt_data;
@@ -96,9 +100,9 @@ facp_table_t *facp_table_gb;  // This should be initialized by parsing the RSDT
 
 // Function to parse the DSDT table and extract sleep states
 void acpi_parse_dsdt(dsdt_table_t *dsdt_table) {
-    // Allocate memory for ACPI data
+    // Keep the ACPI data for good in the boot arena
     uint32_t acpi_data_length = dsdt_table->acpi_header.length - sizeof(dsdt_table_t);
-    dsdt_table->acpi_data = (uint8_t *)memalloc(acpi_data_length);
+    dsdt_table->acpi_data = (uint8_t *)arena_alloc(&boot_arena, acpi_data_length, 4);
     uintptr_t *analyze_addr = (uintptr_t *)(dsdt_table->acpi_data);
 
     // Copy the ACPI data from the DSDT table
@@ -346,20 +350,64 @@ void acpi_parse_hpet(hpet_table_t *hpet_table) {
 void acpi_parse_mcfg(mcfg_table_t *mcfg_table) {
     uint32_t allocation_count = (mcfg_table->header.length - sizeof(acpi_header_t) - sizeof(uint64_t)) / sizeof(mcfg_allocation_t);
 
-    PCIe_data = (mcfg_allocation_t *)memalloc(allocation_count * sizeof(mcfg_allocation_t));
-    if (!PCIe_data) {
+    PCIe_data = (mcfg_allocation_t *)arena_alloc(&boot_arena, allocation_count * sizeof(mcfg_allocation_t), 8);
+    if (PCIe_data == (void *)0xFFFFFFFF) {
         terminal_printf("Failed to allocate memory for PCIe configuration entries.\n");
         return;
     }
 
     // Copy the entries from the table to the allocated memory
     memcpy(PCIe_data, mcfg_table->allocations, allocation_count * sizeof(mcfg_allocation_t));
+
+    pcie_bus_maps = (uint8_t ***)arena_alloc(&boot_arena, allocation_count * sizeof(uint8_t **), 4);
+    if (pcie_bus_maps == (void *)0xFFFFFFFF) {
+        terminal_printf("Failed to allocate memory for PCIe configuration entries.\n");
+        return;
+    }
+    for (uint32_t i = 0; i < allocation_count; i++) {
+        uint32_t buses = PCIe_data[i].bus_end >= PCIe_data[i].bus_start ?
+            PCIe_data[i].bus_end - PCIe_data[i].bus_start + 1 : 0;
+        pcie_bus_maps[i] = buses != 0 ? (uint8_t **)arena_alloc(&boot_arena, buses * sizeof(uint8_t *), 4) : NULL;
+        if (pcie_bus_maps[i] == (void *)0xFFFFFFFF) {
+            terminal_printf("Failed to allocate memory for PCIe configuration entries.\n");
+            return;
+        }
+        if (pcie_bus_maps[i] != NULL) {
+            memset(pcie_bus_maps[i], 0, buses * sizeof(uint8_t *));
+        }
+    }
+    PCIe_count = allocation_count;
+}
+
+// Buses are mapped one at a time as they are first touched and stay mapped,
+// later lookups on the same bus reuse the pointer kept for it
+volatile void *pcie_config_address(uint16_t segment, uint8_t bus, uint8_t device, uint8_t function) {
+    for (uint32_t i = 0; i < PCIe_count; i++) {
+        mcfg_allocation_t *entry = &PCIe_data[i];
+        if (entry->segment_group != segment || bus < entry->bus_start || bus > entry->bus_end) {
+            continue;
+        }
+        uint8_t **slot = &pcie_bus_maps[i][bus - entry->bus_start];
+        if (*slot == NULL) {
+            uint64_t bus_base = entry->base_address + (uint64_t)(bus - entry->bus_start) * PCIE_ECAM_BUS_SIZE;
+            if (bus_base >> 32) {
+                return (void *)0xFFFFFFFF;
+            }
+            uint8_t *config = ioremap_nocache((uint32_t)bus_base, PCIE_ECAM_BUS_SIZE);
+            if (config == (void *)0xFFFFFFFF) {
+                return (void *)0xFFFFFFFF;
+            }
+            *slot = config;
+        }
+        return *slot + PCIE_ECAM_FUNCTION(device & 0x1F, function & 0x7);
+    }
+    return (void *)0xFFFFFFFF;
 }
 
 // Process the SSDT table
 void acpi_parse_ssdt(ssdt_table_t *ssdt_table) {
-    // Dynamically allocate memory for SSDT entries
-    ssdt_entries = (uint8_t *)memalloc(ssdt_table->header.length - sizeof(acpi_header_t));
+    // Keep the SSDT entries for good in the boot arena
+    ssdt_entries = (uint8_t *)arena_alloc(&boot_arena, ssdt_table->header.length - sizeof(acpi_header_t), 4);
 
     // Copy the SSDT entries from the table
     memcpy(ssdt_entries, ssdt_table->ssd_entries, ssdt_table->header.length - sizeof(acpi_header_t));
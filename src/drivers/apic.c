@@ -5,6 +5,8 @@
 #include "idt.h"
 #include "isr.h"
 #include "io.h"
+#include "paging.h"
+#include "vmap.h"
 
 uint32_t apic_base = APIC_BASE;
 uint32_t apic_io_base = APIC_IO_BASE;
@@ -15,7 +17,7 @@ void cpu_set_apic_base(uintptr_t apic) {
    uint32_t eax = (apic & 0xFFFFF000) | IA32_APIC_BASE_MSR_ENABLE; // Ensure address is 4KB aligned
 
 #ifdef __PHYSICAL_MEMORY_EXTENSION__
-   edx = (apic >> 32) & 0x0F; // Handle 64-bit addressing
+   edx = ((uint64_t)apic >> 32) & 0x0F; // Handle 64-bit addressing
 #endif
 
    cpuSetMSR(IA32_APIC_BASE_MSR, eax, edx);
@@ -27,7 +29,7 @@ uintptr_t cpu_get_apic_base() {
    cpuGetMSR(IA32_APIC_BASE_MSR, &eax, &edx);
 
 #ifdef __PHYSICAL_MEMORY_EXTENSION__
-   return (eax & 0xFFFFF000) | ((edx & 0x0F) << 32);
+   return (eax & 0xFFFFF000) | ((uint64_t)(edx & 0x0F) << 32);
 #else
    return (eax & 0xFFFFF000);
 #endif
@@ -49,6 +51,9 @@ void APIC_Initialize() {
     if (local_ioapic_address != 0) {
         apic_io_base = local_ioapic_address;
     }
+    // From here on both hold where the registers are mapped, not where they sit
+    apic_base = (uint32_t)ioremap_nocache(apic_base, PAGING_PAGE_SIZE);
+    apic_io_base = (uint32_t)ioremap_nocache(apic_io_base, PAGING_PAGE_SIZE);
     
     if (apic_addr == 0) {
         // If the APIC base address is 0, it means APIC is not enabled
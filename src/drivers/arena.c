@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+#include "frame.h"
+#include "terminal.h"
+#include "io.h"
+
+arena_t boot_arena = { "boot", NULL, 0, 0, 0 };
+
+void arena_init(arena_t *arena, const char *name) {
+    arena->name = name;
+    arena->chunks = NULL;
+    arena->bytes = 0;
+    arena->chunk_count = 0;
+    arena->sealed = 0;
+}
+
+// Start a new chunk big enough for 'size' bytes at 'alignment'
+static arena_chunk_t *arena_new_chunk(arena_t *arena, size_t size, size_t alignment) {
+    uint32_t order = MAX(frame_order_for(sizeof(arena_chunk_t) + size + alignment), (uint32_t)ARENA_CHUNK_ORDER);
+    uint32_t phys = frame_alloc(order);
+    if (phys == FRAME_NONE) {
+        return NULL;
+    }
+
+    arena_chunk_t *chunk = (arena_chunk_t *)(uintptr_t)phys;
+    chunk->next = arena->chunks;
+    chunk->order = order;
+    chunk->used = sizeof(arena_chunk_t);
+    chunk->size = FRAME_SIZE << order;
+    arena->chunks = chunk;
+    arena->chunk_count++;
+    return chunk;
+}
+
+void *arena_alloc(arena_t *arena, size_t size, size_t alignment) {
+    if (arena->sealed) {
+        terminal_printf("Warning: Allocation from sealed arena %s\n", arena->name);
+        return (void *)0xFFFFFFFF;
+    }
+    if (alignment < sizeof(uint32_t) || (alignment & (alignment - 1)) != 0) {
+        alignment = sizeof(uint32_t);
+    }
+
+    // Bump inside the current chunk, the tail of a full chunk is left unused
+    arena_chunk_t *chunk = arena->chunks;
+    uint32_t offset = 0;
+    if (chunk != NULL) {
+        offset = ((uintptr_t)chunk + chunk->used + alignment - 1) & ~(alignment - 1);
+        offset -= (uintptr_t)chunk;
+    }
+    if (chunk == NULL || offset + size > chunk->size) {
+        arena_chunk_t *old = chunk;
+        chunk = arena_new_chunk(arena, size, alignment);
+        if (chunk == NULL) {
+            return (void *)0xFFFFFFFF;
+        }
+        offset = ((uintptr_t)chunk + chunk->used + alignment - 1) & ~(alignment - 1);
+        offset -= (uintptr_t)chunk;
+
+        // A big request that fills its own chunk should not retire a
+        // current chunk that still has more room left
+        if (old != NULL && old->size - old->used > chunk->size - (offset + size)) {
+            chunk->next = old->next;
+            old->next = chunk;
+            arena->chunks = old;
+        }
+    }
+
+    arena->bytes += offset + size - chunk->used;
+    chunk->used = offset + size;
+    return (uint8_t *)chunk + offset;
+}
+
+// Give every chunk back, all pointers into the arena become invalid
+void arena_reset(arena_t *arena) {
+    if (arena->sealed) {
+        terminal_printf("Warning: Reset of sealed arena %s\n", arena->name);
+        return;
+    }
+    while (arena->chunks != NULL) {
+        arena_chunk_t *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        frame_free((uint32_t)(uintptr_t)chunk, chunk->order);
+    }
+    arena->bytes = 0;
+    arena->chunk_count = 0;
+}
+
+// Freeze the arena, its contents stay valid for good
+void arena_seal(arena_t *arena) {
+    arena->sealed = 1;
+}
@@ -0,0 +1,261 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "clockevent.h"
+#include "timer.h"
+#include "terminal.h"
+#include "io.h"
+
+#define CLOCK_CALIBRATE_NS 10000000     // The PIT wait clock_initialize measures
+
+static uint64_t clock_tsc_base = 0;
+static uint32_t clock_ns_mult = 0;      // Cycles to nanoseconds, CLOCK_SCALE_SHIFT
+static uint32_t clock_cycle_mult = 0;   // Nanoseconds to cycles, CLOCK_SCALE_SHIFT
+static uint32_t clock_calibrated_cycles = 0;
+
+static clockevent_device_t *clockevent_device = NULL;
+static timer_event_t *timer_queue = NULL;  // Soonest first
+
+static struct {
+    uint32_t interrupts;
+    uint32_t early;         // Interrupts with nothing due, a max_delta step or a cancelled timer
+    uint32_t expired;       // Timers run
+    uint32_t programmed;    // Times a device was armed
+    uint32_t passed;        // Arms the device reported too late, run at once instead
+    uint32_t stopped;       // Times the queue ran dry and the device was left off
+    uint32_t avg_late_ns;   // Running average of how long after expiry timers ran
+    uint32_t max_late_ns;
+    uint32_t idles;
+    uint64_t idle_ns;
+} clockevent_stats;
+
+// ---------------------------------------------------------------------------
+// Clock
+//
+// The TSC is taken to tick at a constant rate, which every CPU with
+// TSC-deadline does and QEMU always does.
+// ---------------------------------------------------------------------------
+void clock_initialize() {
+    if (clock_calibrated_cycles != 0) {
+        return;
+    }
+    pit_prepare_sleep(CLOCK_CALIBRATE_NS / 1000);
+    uint64_t start = rdtsc();
+    pit_perform_sleep();
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    clock_calibrated_cycles = cycles;
+    clock_ns_mult = (uint32_t)clock_div((uint64_t)CLOCK_CALIBRATE_NS << CLOCK_SCALE_SHIFT, cycles);
+    clock_cycle_mult = (uint32_t)clock_div((uint64_t)cycles << CLOCK_SCALE_SHIFT, CLOCK_CALIBRATE_NS);
+    clock_tsc_base = rdtsc();
+    terminal_printf("Clock: TSC at %u kHz\n", cycles / (CLOCK_CALIBRATE_NS / 1000000));
+}
+
+uint64_t clock_now_ns() {
+    return clock_scale(rdtsc() - clock_tsc_base, clock_ns_mult, CLOCK_SCALE_SHIFT);
+}
+
+uint64_t clock_ns_to_cycles(uint64_t ns) {
+    return clock_scale(ns, clock_cycle_mult, CLOCK_SCALE_SHIFT);
+}
+
+// ---------------------------------------------------------------------------
+// Devices
+// ---------------------------------------------------------------------------
+static uint32_t clockevent_run_expired() {
+    uint32_t ran = 0;
+    uint64_t now = clock_now_ns();
+    while (timer_queue != NULL && timer_queue->expires_ns <= now) {
+        timer_event_t *event = timer_queue;
+        timer_queue = event->next;
+        event->queued = false;
+
+        uint32_t late = (uint32_t)MIN(now - event->expires_ns, 0x7FFFFFFFULL);
+        clockevent_stats.avg_late_ns += ((int32_t)late - (int32_t)clockevent_stats.avg_late_ns) / 16;
+        clockevent_stats.max_late_ns = MAX(clockevent_stats.max_late_ns, late);
+        clockevent_stats.expired++;
+
+        // The callback may queue timers again, the queue is consistent here
+        event->callback(event->data);
+        now = clock_now_ns();
+        ran++;
+    }
+    return ran;
+}
+
+// Arm the device for the head of the queue, or stop it when there is none.
+// Interrupts are off.
+static void clockevent_program() {
+    clockevent_device_t *device = clockevent_device;
+    if (device == NULL) {
+        return;
+    }
+    while (timer_queue != NULL) {
+        uint64_t now = clock_now_ns();
+        uint64_t delta = timer_queue->expires_ns > now ? timer_queue->expires_ns - now : 0;
+        delta = MAX(delta, device->min_delta_ns);
+        delta = MIN(delta, device->max_delta_ns);
+        clockevent_stats.programmed++;
+        if (device->set_next(delta)) {
+            return;
+        }
+        clockevent_stats.passed++;
+        clockevent_run_expired();
+    }
+    device->stop();
+    clockevent_stats.stopped++;
+}
+
+void clockevent_register(clockevent_device_t *device) {
+    uintptr_t flags = irq_save();
+    if (clockevent_device != NULL && clockevent_device->rating >= device->rating) {
+        irq_restore(flags);
+        return;
+    }
+    if (clockevent_device != NULL) {
+        clockevent_device->stop();
+    }
+    clockevent_device = device;
+    clockevent_program();
+    irq_restore(flags);
+    terminal_printf("Clock events: %s\n", device->name);
+}
+
+void clockevent_resume() {
+    uintptr_t flags = irq_save();
+    clockevent_program();
+    irq_restore(flags);
+}
+
+void clockevent_interrupt() {
+    ++timer_ticks;
+    clockevent_stats.interrupts++;
+    if (clockevent_run_expired() == 0) {
+        clockevent_stats.early++;
+    }
+    clockevent_program();
+}
+
+// ---------------------------------------------------------------------------
+// Timers
+// ---------------------------------------------------------------------------
+static void timer_queue_remove(timer_event_t *event) {
+    timer_event_t **link = &timer_queue;
+    while (*link != NULL && *link != event) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = event->next;
+    }
+    event->queued = false;
+}
+
+void timer_event_add(timer_event_t *event, uint64_t expires_ns, timer_callback_t callback, void *data) {
+    uintptr_t flags = irq_save();
+    if (event->queued) {
+        timer_queue_remove(event);
+    }
+    event->expires_ns = expires_ns;
+    event->callback = callback;
+    event->data = data;
+
+    // Equal expiries run in the order they were added
+    timer_event_t **link = &timer_queue;
+    while (*link != NULL && (*link)->expires_ns <= expires_ns) {
+        link = &(*link)->next;
+    }
+    event->next = *link;
+    *link = event;
+    event->queued = true;
+
+    if (timer_queue == event) {
+        clockevent_program();
+    }
+    irq_restore(flags);
+}
+
+void timer_event_cancel(timer_event_t *event) {
+    uintptr_t flags = irq_save();
+    if (event->queued) {
+        bool head = timer_queue == event;
+        timer_queue_remove(event);
+        // Left armed, the device would only wake up to find nothing due
+        if (head) {
+            clockevent_program();
+        }
+    }
+    irq_restore(flags);
+}
+
+static void timer_sleep_wake(void *data) {
+    *(volatile bool *)data = true;
+}
+
+void timer_sleep_ns(uint64_t ns) {
+    uint64_t expires = clock_now_ns() + ns;
+    if (clockevent_device == NULL) {
+        while (clock_now_ns() < expires) {
+            asm("pause");
+        }
+        return;
+    }
+    volatile bool done = false;
+    timer_event_t event = { .queued = false };
+    uintptr_t flags = irq_save();
+    timer_event_add(&event, expires, timer_sleep_wake, (void *)&done);
+    while (!done) {
+        clockevent_idle();
+        CLI();
+    }
+    irq_restore(flags);
+}
+
+// ---------------------------------------------------------------------------
+// Idle
+//
+// Called with interrupts off, once the caller has seen it has nothing to
+// do. sti only takes effect after the next instruction, so an interrupt
+// that comes in after the caller's check still ends the hlt instead of
+// being taken before it. Returns with interrupts on.
+// ---------------------------------------------------------------------------
+void clockevent_idle() {
+    uint64_t start = clock_now_ns();
+    asm("sti; hlt" : : : "memory");
+    uint64_t idle = clock_now_ns() - start;
+    uintptr_t flags = irq_save();
+    clockevent_stats.idles++;
+    clockevent_stats.idle_ns += idle;
+    irq_restore(flags);
+}
+
+void clockevent_benchmark() {
+    static const uint32_t waits_us[] = { 20, 100, 500, 2000, 20000 };
+    if (clockevent_device == NULL) {
+        terminal_printf("Error: No clock event device.\n");
+        return;
+    }
+    terminal_printf("Timer sleeps on %s, requested against measured:\n", clockevent_device->name);
+    for (uint32_t i = 0; i < sizeof(waits_us) / sizeof(waits_us[0]); i++) {
+        uint32_t interrupts = clockevent_stats.interrupts;
+        uint64_t start = clock_now_ns();
+        timer_sleep_ns((uint64_t)waits_us[i] * 1000);
+        uint32_t elapsed = (uint32_t)(clock_now_ns() - start);
+        terminal_printf("  %u us: %u ns, %u interrupts\n",
+            waits_us[i], elapsed, clockevent_stats.interrupts - interrupts);
+    }
+}
+
+void clockevent_print_stats() {
+    uint64_t now = clock_now_ns();
+    terminal_printf("Clock events: %s, up %u ms, %u ms idle in %u halts\n",
+        clockevent_device != NULL ? clockevent_device->name : "none",
+        (uint32_t)clock_div(now, 1000000), (uint32_t)clock_div(clockevent_stats.idle_ns, 1000000),
+        clockevent_stats.idles);
+    terminal_printf("  %u interrupts (%u early), %u timers run, %u arms, %u passed, %u stops\n",
+        clockevent_stats.interrupts, clockevent_stats.early, clockevent_stats.expired,
+        clockevent_stats.programmed, clockevent_stats.passed, clockevent_stats.stopped);
+    terminal_printf("  lateness: ~%u ns average, %u ns max\n",
+        clockevent_stats.avg_late_ns, clockevent_stats.max_late_ns);
+}
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "demand.h"
+#include "paging.h"
+#include "frame.h"
+#include "memory.h"
+#include "tlb.h"
+#include "terminal.h"
+#include "io.h"
+
+static uint32_t demand_map[DEMAND_WINDOW_PAGES / 32];  // Bit set while the page is reserved
+static uint32_t demand_hint = 0;                        // Where the next search starts
+static uint32_t demand_zero_frame = FRAME_NONE;         // Shared by every page read before it was written
+
+static struct {
+    uint32_t reserved_pages;
+    uint32_t resident_pages;    // Private frames behind reserved pages
+    uint32_t zero_faults;       // Reads that mapped the zero page
+    uint32_t write_faults;      // Writes to pages that were not mapped at all
+    uint32_t cow_faults;        // Writes to pages that had the zero page
+    uint32_t failed;            // No frame left, the fault goes on to the panic path
+    uint32_t avg_cycles;        // Running average over the last few dozen faults
+    uint32_t max_cycles;
+} demand_stats;
+
+void demand_initialize() {
+    demand_zero_frame = frame_alloc_zeroed();
+    if (demand_zero_frame == FRAME_NONE) {
+        terminal_printf("Warning: No frame for the zero page, demand paging is off.\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Window
+// ---------------------------------------------------------------------------
+static inline uint8_t demand_reserved(uint32_t page) {
+    return (demand_map[page >> 5] >> (page & 31)) & 1;
+}
+
+static void demand_mark(uint32_t first, uint32_t count, uint8_t reserved) {
+    for (uint32_t page = first; page < first + count; page++) {
+        if (reserved) {
+            demand_map[page >> 5] |= 1 << (page & 31);
+        } else {
+            demand_map[page >> 5] &= ~(1 << (page & 31));
+        }
+    }
+}
+
+// First run of 'count' free pages, searching from the hint and wrapping once
+static uint32_t demand_find(uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t scanned = 0, page = demand_hint; scanned < DEMAND_WINDOW_PAGES + count; scanned++, page++) {
+        if (page == DEMAND_WINDOW_PAGES) {
+            page = 0;
+            run = 0;
+        }
+        if (demand_reserved(page)) {
+            run = 0;
+        } else if (++run == count) {
+            return page + 1 - count;
+        }
+    }
+    return DEMAND_WINDOW_PAGES;
+}
+
+void *demand_reserve(size_t size) {
+    uint32_t count = (size + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    if (count == 0 || count > DEMAND_WINDOW_PAGES || demand_zero_frame == FRAME_NONE) {
+        return (void *)0xFFFFFFFF;
+    }
+    uintptr_t flags = irq_save();
+    uint32_t first = demand_find(count);
+    if (first == DEMAND_WINDOW_PAGES) {
+        irq_restore(flags);
+        return (void *)0xFFFFFFFF;
+    }
+    demand_mark(first, count, 1);
+    demand_hint = first + count;
+    demand_stats.reserved_pages += count;
+    irq_restore(flags);
+    return (void *)(DEMAND_WINDOW_BASE + (first << FRAME_SHIFT));
+}
+
+void demand_release(void *ptr, size_t size) {
+    if (ptr == NULL || ptr == (void *)0xFFFFFFFF) {
+        return;
+    }
+    uint32_t virt = (uint32_t)ptr;
+    uint32_t first = (virt - DEMAND_WINDOW_BASE) >> FRAME_SHIFT;
+    uint32_t count = (size + FRAME_SIZE - 1) >> FRAME_SHIFT;
+
+    uintptr_t flags = irq_save();
+    tlb_gather_t gather;
+    tlb_gather_init(&gather);
+    for (uint32_t i = 0; i < count; i++, virt += FRAME_SIZE) {
+        pte_t entry = paging_get_entry(virt);
+        if (!(entry & PAGING_PAGE_PRESENT)) {
+            continue;
+        }
+        uint8_t private = (entry & PAGING_FRAME_MASK) != demand_zero_frame;
+        demand_stats.resident_pages -= private;
+        tlb_gather_unmap(&gather, virt, private);
+    }
+    tlb_gather_flush(&gather);
+    demand_mark(first, count, 0);
+    demand_stats.reserved_pages -= count;
+    irq_restore(flags);
+}
+
+// ---------------------------------------------------------------------------
+// Faults
+// ---------------------------------------------------------------------------
+bool demand_fault(uint32_t fault_addr, uint32_t error) {
+    if (fault_addr < DEMAND_WINDOW_BASE || fault_addr >= DEMAND_WINDOW_BASE + (DEMAND_WINDOW_PAGES << FRAME_SHIFT) ||
+            !demand_reserved((fault_addr - DEMAND_WINDOW_BASE) >> FRAME_SHIFT)) {
+        return false;
+    }
+    uint64_t start = rdtsc();
+    uint32_t virt = fault_addr & 0xFFFFF000;
+    uint8_t write = (error & PAGING_FAULT_WRITE) != 0;
+
+    // A present page only faults here when it is the zero page being written
+    if ((error & PAGING_FAULT_PRESENT) && (!write || (paging_get_entry(virt) & PAGING_FRAME_MASK) != demand_zero_frame)) {
+        return false;
+    }
+
+    if (write) {
+        // High memory first, nothing else can use it. It is cleared through
+        // the new mapping, low frames may come cleared already.
+        phys_addr_t frame = frame_alloc_high();
+        uint8_t high = frame != FRAME_HIGH_NONE;
+        if (!high) {
+            uint32_t low = frame_alloc_zeroed();
+            if (low == FRAME_NONE) {
+                demand_stats.failed++;
+                return false;
+            }
+            frame = low;
+        }
+        set_page_mapping(virt, frame, PAGE_SYSGLOBAL | PAGE_EXECUTE_DISABLE);
+        if (virt_to_phys(virt) == PAGING_NO_MAPPING) {
+            // No frame for the page table either
+            frame_free_high(frame);
+            demand_stats.failed++;
+            return false;
+        }
+        if (high) {
+            asm("invlpg (%0)" : : "r" (virt) : "memory");
+            memset_nosse((void *)virt, 0, FRAME_SIZE);
+        }
+        demand_stats.resident_pages++;
+        if (error & PAGING_FAULT_PRESENT) {
+            demand_stats.cow_faults++;
+        } else {
+            demand_stats.write_faults++;
+        }
+    } else {
+        set_page_mapping(virt, demand_zero_frame, PAGE_SYSRODATA | PAGE_GLOBAL);
+        if (virt_to_phys(virt) == PAGING_NO_MAPPING) {
+            demand_stats.failed++;
+            return false;
+        }
+        demand_stats.zero_faults++;
+    }
+    // Only the zero page mapping can be cached, but it is one page either way
+    asm("invlpg (%0)" : : "r" (virt) : "memory");
+
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    demand_stats.avg_cycles += ((int32_t)cycles - (int32_t)demand_stats.avg_cycles) / 16;
+    demand_stats.max_cycles = MAX(demand_stats.max_cycles, cycles);
+    return true;
+}
+
+void demand_print_stats() {
+    terminal_printf("Demand: %u pages reserved, %u resident\n",
+        demand_stats.reserved_pages, demand_stats.resident_pages);
+    terminal_printf("  faults: %u zero page reads, %u writes, %u zero page writes, %u failed\n",
+        demand_stats.zero_faults, demand_stats.write_faults, demand_stats.cow_faults, demand_stats.failed);
+    terminal_printf("  latency: ~%u cycles average, %u max\n", demand_stats.avg_cycles, demand_stats.max_cycles);
+}
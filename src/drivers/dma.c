@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "dma.h"
+#include "frame.h"
+#include "terminal.h"
+#include "io.h"
+
+#define DMA_ZONE_COUNT     2
+#define DMA_MAX_ZONE_PAGES (1 << DMA_32_ZONE_ORDER)
+
+typedef struct {
+    const char *name;
+    uint64_t limit;            // Every byte of the zone lies below this
+    uint32_t base;             // Physical start, FRAME_NONE if the zone could not be set up
+    uint32_t pages;
+    uint32_t used_pages;
+    uint32_t failed;
+    uint32_t map[DMA_MAX_ZONE_PAGES / 32]; // Bit set while the page is handed out
+} dma_zone_t;
+
+static dma_zone_t dma_zones[DMA_ZONE_COUNT] = {
+    { "isa",   DMA_ISA_LIMIT, FRAME_NONE, 0, 0, 0, { 0 } },
+    { "dma32", DMA_32_LIMIT,  FRAME_NONE, 0, 0, 0, { 0 } },
+};
+
+static inline uint8_t dma_page_used(dma_zone_t *zone, uint32_t page) {
+    return (zone->map[page >> 5] >> (page & 31)) & 1;
+}
+
+static void dma_mark(dma_zone_t *zone, uint32_t first, uint32_t count, uint8_t used) {
+    for (uint32_t page = first; page < first + count; page++) {
+        if (used) {
+            zone->map[page >> 5] |= 1 << (page & 31);
+        } else {
+            zone->map[page >> 5] &= ~(1 << (page & 31));
+        }
+    }
+}
+
+// Carve one zone, halving the size until the frame allocator can serve it
+static void dma_carve(dma_zone_t *zone, uint32_t order) {
+    for (; order >= DMA_MIN_ZONE_ORDER; order--) {
+        uint32_t phys = frame_alloc_below(order, zone->limit);
+        if (phys != FRAME_NONE) {
+            zone->base = phys;
+            zone->pages = 1 << order;
+            return;
+        }
+    }
+}
+
+void dma_initialize() {
+    dma_carve(&dma_zones[0], DMA_ISA_ZONE_ORDER);
+    dma_carve(&dma_zones[1], DMA_32_ZONE_ORDER);
+
+    for (uint32_t i = 0; i < DMA_ZONE_COUNT; i++) {
+        if (dma_zones[i].base == FRAME_NONE) {
+            terminal_printf("Warning: No room for the %s DMA zone.\n", dma_zones[i].name);
+        }
+    }
+}
+
+// First run of 'count' free pages in the zone, FRAME_NONE if there is none.
+// With DMA_NO_64K_CROSS a run that would straddle a boundary restarts at it.
+static uint32_t dma_find(dma_zone_t *zone, uint32_t count, uint32_t flags) {
+    uint32_t boundary_pages = DMA_BOUNDARY >> FRAME_SHIFT;
+    uint32_t run = 0;
+    for (uint32_t page = 0; page < zone->pages; page++) {
+        uint32_t pfn = (zone->base >> FRAME_SHIFT) + page;
+        if ((flags & DMA_NO_64K_CROSS) && (pfn % boundary_pages) == 0) {
+            run = 0;
+        }
+        if (dma_page_used(zone, page)) {
+            run = 0;
+        } else if (++run == count) {
+            return page + 1 - count;
+        }
+    }
+    return FRAME_NONE;
+}
+
+void *dma_alloc(size_t size, uint32_t flags, uint32_t *phys) {
+    uint32_t count = (size + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    if (count == 0 || ((flags & DMA_NO_64K_CROSS) && size > DMA_BOUNDARY)) {
+        return (void *)0xFFFFFFFF;
+    }
+
+    // The ISA zone also suits 32-bit masters, but it is the scarce one so
+    // they only fall back to it
+    static const uint32_t isa_order[] = { 0 };
+    static const uint32_t dma32_order[] = { 1, 0 };
+    const uint32_t *order = (flags & DMA_ZONE_ISA) ? isa_order : dma32_order;
+    uint32_t tries = (flags & DMA_ZONE_ISA) ? 1 : 2;
+
+    uintptr_t irq_flags = irq_save();
+    for (uint32_t i = 0; i < tries; i++) {
+        dma_zone_t *zone = &dma_zones[order[i]];
+        if (zone->base == FRAME_NONE) {
+            continue;
+        }
+        uint32_t first = dma_find(zone, count, flags);
+        if (first != FRAME_NONE) {
+            dma_mark(zone, first, count, 1);
+            zone->used_pages += count;
+            irq_restore(irq_flags);
+
+            *phys = zone->base + (first << FRAME_SHIFT);
+            return (void *)(uintptr_t)*phys; // Zones sit in the identity mapped range
+        }
+        zone->failed++;
+    }
+    irq_restore(irq_flags);
+    return (void *)0xFFFFFFFF;
+}
+
+void dma_free(void *virt, size_t size) {
+    if (virt == NULL || virt == (void *)0xFFFFFFFF) {
+        return;
+    }
+    uint32_t phys = (uint32_t)(uintptr_t)virt;
+    uint32_t count = (size + FRAME_SIZE - 1) >> FRAME_SHIFT;
+
+    uintptr_t irq_flags = irq_save();
+    for (uint32_t i = 0; i < DMA_ZONE_COUNT; i++) {
+        dma_zone_t *zone = &dma_zones[i];
+        if (zone->base != FRAME_NONE && phys >= zone->base && phys < zone->base + (zone->pages << FRAME_SHIFT)) {
+            dma_mark(zone, (phys - zone->base) >> FRAME_SHIFT, count, 0);
+            zone->used_pages -= count;
+            break;
+        }
+    }
+    irq_restore(irq_flags);
+}
+
+void dma_print_stats() {
+    for (uint32_t i = 0; i < DMA_ZONE_COUNT; i++) {
+        dma_zone_t *zone = &dma_zones[i];
+        if (zone->base == FRAME_NONE) {
+            continue;
+        }
+        terminal_printf("DMA %s: 0x%x, %u of %u pages used, %u failed\n",
+            zone->name, zone->base, zone->used_pages, zone->pages, zone->failed);
+    }
+}
@@ -0,0 +1,541 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "multiboot2.h"
+#include "frame.h"
+#include "memory.h"
+#include "terminal.h"
+#include "io.h"
+
+#define FRAME_NIL             0xFFFFFFFF
+#define FRAME_MAX_RESERVED    4
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} frame_range_t;
+
+static frame_info_t *frame_info = NULL;
+static uint32_t frame_count = 0;                        // Frames covered by frame_info
+static uint32_t frame_free_lists[FRAME_MAX_ORDER + 1];  // Head frame of each order's free list
+static uint32_t frame_order_map = 0;                    // Bit N set while order N has free blocks
+static uint32_t frames_free = 0;
+static uint32_t frames_usable = 0;
+
+static frame_range_t frame_reserved[FRAME_MAX_RESERVED];
+static uint32_t frame_reserved_count = 0;
+
+static uint32_t frame_zero_pool[FRAME_ZERO_POOL_SIZE];  // Pages known to be all zero
+static uint32_t frame_zero_count = 0;
+static uint32_t frame_zero_hits = 0;
+static uint32_t frame_zero_misses = 0;
+
+static uint32_t frame_colors = FRAME_DEFAULT_COLORS;
+static uint32_t frame_color_next = 0;
+
+static uint32_t *frame_high_map = NULL;                 // Bit set while the high frame is free
+static uint32_t frame_high_count = 0;                   // Frames covered by frame_high_map
+static uint32_t frame_high_hint = 0;                    // Word where the next search starts
+static uint32_t frames_high_free = 0;
+static uint32_t frames_high_usable = 0;
+
+// ---------------------------------------------------------------------------
+// Buddy free lists
+//
+// Every order keeps a doubly linked list of free blocks, linked by frame
+// number through frame_info. A block's buddy is found by flipping bit 'order'
+// of its frame number, so merging on free and splitting on allocation both
+// take at most FRAME_MAX_ORDER steps.
+// ---------------------------------------------------------------------------
+static void frame_list_push(uint32_t pfn, uint32_t order) {
+    frame_info_t *info = &frame_info[pfn];
+    info->order = order;
+    info->flags |= FRAME_FLAG_FREE;
+    info->prev = FRAME_NIL;
+    info->next = frame_free_lists[order];
+    if (frame_free_lists[order] != FRAME_NIL) {
+        frame_info[frame_free_lists[order]].prev = pfn;
+    }
+    frame_free_lists[order] = pfn;
+    frame_order_map |= (1 << order);
+}
+
+static void frame_list_remove(uint32_t pfn) {
+    frame_info_t *info = &frame_info[pfn];
+    if (info->prev != FRAME_NIL) {
+        frame_info[info->prev].next = info->next;
+    } else {
+        frame_free_lists[info->order] = info->next;
+    }
+    if (info->next != FRAME_NIL) {
+        frame_info[info->next].prev = info->prev;
+    }
+    if (frame_free_lists[info->order] == FRAME_NIL) {
+        frame_order_map &= ~(1 << info->order);
+    }
+    info->flags &= ~FRAME_FLAG_FREE;
+}
+
+static void frame_free_block(uint32_t pfn, uint32_t order) {
+    while (order < FRAME_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1 << order);
+        if (buddy >= frame_count) {
+            break;
+        }
+        frame_info_t *info = &frame_info[buddy];
+        if (!(info->flags & FRAME_FLAG_FREE) || info->order != order) {
+            break;
+        }
+        frame_list_remove(buddy);
+        pfn &= ~(1 << order);
+        ++order;
+    }
+    frame_list_push(pfn, order);
+}
+
+// Free the frames in [start, end) as the largest aligned blocks that fit
+static void frame_free_range(uint32_t start, uint32_t end) {
+    while (start < end) {
+        uint32_t order = FRAME_MAX_ORDER;
+        if (start != 0 && (uint32_t)LOBIT(start) < order) {
+            order = LOBIT(start);
+        }
+        while (start + (1 << order) > end) {
+            --order;
+        }
+        frame_free_block(start, order);
+        frames_free += 1 << order;
+        start += 1 << order;
+    }
+}
+
+// Hand [start, end) to the allocator minus every reserved range from 'first' on
+static void frame_release(uint64_t start, uint64_t end, uint32_t first) {
+    for (uint32_t i = first; i < frame_reserved_count; i++) {
+        frame_range_t *range = &frame_reserved[i];
+        if (start < range->end && end > range->start) {
+            if (start < range->start) {
+                frame_release(start, range->start, i + 1);
+            }
+            if (end > range->end) {
+                frame_release(range->end, end, i + 1);
+            }
+            return;
+        }
+    }
+
+    start = (start + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+    end &= ~(uint64_t)(FRAME_SIZE - 1);
+    if (end > start) {
+        frame_free_range((uint32_t)(start >> FRAME_SHIFT), (uint32_t)(end >> FRAME_SHIFT));
+        frames_usable += (uint32_t)((end - start) >> FRAME_SHIFT);
+    }
+}
+
+static void frame_reserve(uint64_t start, uint64_t end) {
+    if (frame_reserved_count < FRAME_MAX_RESERVED && end > start) {
+        frame_reserved[frame_reserved_count].start = start & ~(uint64_t)(FRAME_SIZE - 1);
+        frame_reserved[frame_reserved_count].end = (end + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+        ++frame_reserved_count;
+    }
+}
+
+// Usable part of an mmap entry, clipped to what the identity map can reach
+static uint8_t frame_entry_range(multiboot_mmap_entry_t *entry, uint64_t *start, uint64_t *end) {
+    if (entry->type != MULTIBOOT_MEMORY_AVAILABLE) {
+        return 0;
+    }
+    *start = mmap_entry_base(entry);
+    *end = *start + mmap_entry_length(entry);
+    if (*end > FRAME_DIRECT_LIMIT) {
+        *end = FRAME_DIRECT_LIMIT;
+    }
+    return *end > *start;
+}
+
+// First spot of 'size' bytes in [start, end) that misses every reserved range
+static uint64_t frame_find_clear(uint64_t start, uint64_t end, uint64_t size) {
+    start = (start + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+    while (start + size <= end) {
+        uint8_t moved = 0;
+        for (uint32_t i = 0; i < frame_reserved_count; i++) {
+            if (start < frame_reserved[i].end && start + size > frame_reserved[i].start) {
+                start = frame_reserved[i].end;
+                moved = 1;
+            }
+        }
+        if (!moved) {
+            return start;
+        }
+    }
+    return FRAME_LIMIT;
+}
+
+// ---------------------------------------------------------------------------
+// Page coloring
+//
+// A physically indexed L2 with ways of W bytes sees frame N in the same sets
+// as frame N + W / FRAME_SIZE, so frames fall into W / FRAME_SIZE colors.
+// Buddy blocks are naturally aligned, which puts the start of every large
+// buffer on color 0 and makes big buffers used together evict each other.
+// Colored runs start where the previous one ended instead, so a few buffers
+// worth of frames cover the cache evenly.
+// ---------------------------------------------------------------------------
+static void frame_color_detect() {
+    // Ways in the AMD-style 4-bit L2 associativity field, 0 for unknown/fully associative
+    static const uint8_t l2_ways[16] = { 0, 1, 2, 0, 4, 0, 8, 0, 16, 0, 32, 48, 64, 96, 128, 0 };
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000006) {
+        return;
+    }
+    cpuid(0x80000006, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t size = (ecx >> 16) << 10;
+    uint32_t ways = l2_ways[(ecx >> 12) & 0xF];
+    if (size == 0 || ways == 0) {
+        return;
+    }
+
+    uint32_t colors = size / ways / FRAME_SIZE;
+    if (colors == 0) {
+        colors = 1;
+    }
+    frame_colors = MIN(1u << HIBIT(colors), (uint32_t)FRAME_MAX_COLORS);
+}
+
+uint32_t frame_color_count() {
+    return frame_colors;
+}
+
+// ---------------------------------------------------------------------------
+// High memory
+//
+// RAM past FRAME_DIRECT_LIMIT has no address in the identity map, so nothing
+// can keep buddy links in it or clear it ahead of time. Its frames are handed
+// out one at a time from a bitmap, to mappings that only need some frame
+// behind each page: demand-zero pages and vmalloc buffers.
+// ---------------------------------------------------------------------------
+static uint8_t frame_high_range(multiboot_mmap_entry_t *entry, uint64_t *start, uint64_t *end) {
+    if (entry->type != MULTIBOOT_MEMORY_AVAILABLE) {
+        return 0;
+    }
+    *start = MAX(mmap_entry_base(entry), FRAME_DIRECT_LIMIT);
+    *end = MIN(mmap_entry_base(entry) + mmap_entry_length(entry), FRAME_HIGH_LIMIT);
+    *start = (*start + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+    *end &= ~(uint64_t)(FRAME_SIZE - 1);
+    return *end > *start;
+}
+
+static void frame_high_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_t *mmap_tag) {
+    uint64_t start, end, top = FRAME_DIRECT_LIMIT;
+    for (uint32_t i = 0; i < entry_count; i++) {
+        multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)(entry + (i * mmap_tag->entry_size));
+        if (frame_high_range(entry_x, &start, &end) && end > top) {
+            top = end;
+        }
+    }
+    frame_high_count = (uint32_t)((top - FRAME_DIRECT_LIMIT) >> FRAME_SHIFT);
+    if (frame_high_count == 0) {
+        return;
+    }
+
+    // The bitmap itself has to be reachable, so it comes from low memory
+    uint32_t map_size = ((frame_high_count + 31) >> 5) * sizeof(uint32_t);
+    uint32_t map = frame_alloc_pages((map_size + FRAME_SIZE - 1) >> FRAME_SHIFT);
+    if (map == FRAME_NONE) {
+        terminal_printf("Warning: No room for the high memory bitmap, %u MiB left unused.\n", frame_high_count >> 8);
+        frame_high_count = 0;
+        return;
+    }
+    frame_high_map = (uint32_t *)map;
+    memset(frame_high_map, 0, map_size);
+
+    for (uint32_t i = 0; i < entry_count; i++) {
+        multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)(entry + (i * mmap_tag->entry_size));
+        if (!frame_high_range(entry_x, &start, &end)) {
+            continue;
+        }
+        uint32_t first = (uint32_t)((start - FRAME_DIRECT_LIMIT) >> FRAME_SHIFT);
+        uint32_t last = (uint32_t)((end - FRAME_DIRECT_LIMIT) >> FRAME_SHIFT);
+        for (uint32_t index = first; index < last; index++) {
+            frame_high_map[index >> 5] |= 1u << (index & 31);
+        }
+        frames_high_usable += last - first;
+    }
+    frames_high_free = frames_high_usable;
+    terminal_printf("High memory: %u MiB in %u frames above the identity map\n",
+        frames_high_usable >> 8, frames_high_usable);
+}
+
+phys_addr_t frame_alloc_high() {
+    if (frames_high_free == 0) {
+        return FRAME_HIGH_NONE;
+    }
+    uint32_t words = (frame_high_count + 31) >> 5;
+    for (uint32_t scanned = 0, word = frame_high_hint; scanned < words; scanned++, word++) {
+        if (word == words) {
+            word = 0;
+        }
+        if (frame_high_map[word] != 0) {
+            uint32_t bit = LOBIT(frame_high_map[word]);
+            frame_high_map[word] &= ~(1u << bit);
+            frame_high_hint = word;
+            frames_high_free--;
+            return (phys_addr_t)(FRAME_DIRECT_LIMIT + ((uint64_t)((word << 5) + bit) << FRAME_SHIFT));
+        }
+    }
+    return FRAME_HIGH_NONE;
+}
+
+void frame_free_high(phys_addr_t phys_addr) {
+    if (phys_addr == FRAME_HIGH_NONE) {
+        return;
+    }
+    if (phys_addr < FRAME_DIRECT_LIMIT) {
+        frame_free_page((uint32_t)phys_addr);
+        return;
+    }
+    uint32_t index = (uint32_t)((phys_addr - FRAME_DIRECT_LIMIT) >> FRAME_SHIFT);
+    if (index >= frame_high_count) {
+        return;
+    }
+    if (frame_high_map[index >> 5] & (1u << (index & 31))) {
+        terminal_printf("Warning: Double free of high frame %u\n", index);
+        return;
+    }
+    frame_high_map[index >> 5] |= 1u << (index & 31);
+    frames_high_free++;
+}
+
+uint32_t frame_high_free_count() {
+    return frames_high_free;
+}
+
+uint32_t frame_high_total_count() {
+    return frames_high_usable;
+}
+
+void frame_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_t *mmap_tag) {
+    uint64_t start, end, top = 0;
+
+    for (uint32_t i = 0; i < FRAME_MAX_ORDER + 1; i++) {
+        frame_free_lists[i] = FRAME_NIL;
+    }
+
+    // Firmware area, the kernel image and the multiboot info we are still parsing
+    frame_reserve(0, FRAME_LOW_RESERVED);
+    frame_reserve(KERNEL_PHYS(&_cstart), KERNEL_PHYS(&_end));
+    frame_reserve((uint32_t)multiboot_data.ebx_reg, (uint32_t)multiboot_data.ebx_reg + multiboot_data.ebx_reg->total_size);
+
+    // The highest usable address decides how many frames we track
+    for (uint32_t i = 0; i < entry_count; i++) {
+        multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)(entry + (i * mmap_tag->entry_size));
+        if (frame_entry_range(entry_x, &start, &end) && end > top) {
+            top = end;
+        }
+    }
+    frame_count = (uint32_t)(top >> FRAME_SHIFT);
+    uint64_t info_size = (uint64_t)frame_count * sizeof(frame_info_t);
+
+    // Place the frame table in the first free spot that can hold it
+    uint64_t info_addr = FRAME_LIMIT;
+    for (uint32_t i = 0; i < entry_count && info_addr == FRAME_LIMIT; i++) {
+        multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)(entry + (i * mmap_tag->entry_size));
+        if (frame_entry_range(entry_x, &start, &end)) {
+            info_addr = frame_find_clear(start, end, info_size);
+        }
+    }
+    if (info_addr == FRAME_LIMIT) {
+        terminal_printf("Error: No room for the page frame table (%u frames).\n", frame_count);
+        frame_count = 0;
+        return;
+    }
+    frame_info = (frame_info_t *)(uint32_t)info_addr;
+    memset(frame_info, 0, (size_t)info_size);
+    frame_reserve(info_addr, info_addr + info_size);
+
+    for (uint32_t i = 0; i < entry_count; i++) {
+        multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)(entry + (i * mmap_tag->entry_size));
+        if (frame_entry_range(entry_x, &start, &end)) {
+            frame_release(start, end, 0);
+        }
+    }
+
+    frame_color_detect();
+    terminal_printf("Page frames: %u free of %u (table at 0x%x), %u cache colors\n",
+        frames_free, frame_count, frame_info, frame_colors);
+    frame_high_initialize(entry, entry_count, mmap_tag);
+}
+
+// Take the free block of 'found' order at pfn, keeping only the first 2^order frames
+static uint32_t frame_take(uint32_t pfn, uint32_t found, uint32_t order) {
+    frame_list_remove(pfn);
+
+    // Hand the upper halves back until the block is the requested size
+    while (found > order) {
+        --found;
+        frame_list_push(pfn + (1 << found), found);
+    }
+
+    frame_info[pfn].order = order;
+    frames_free -= 1 << order;
+    return pfn << FRAME_SHIFT;
+}
+
+// Allocate 2^order contiguous frames, returns the physical address or FRAME_NONE
+uint32_t frame_alloc(uint32_t order) {
+    if (order > FRAME_MAX_ORDER) {
+        return FRAME_NONE;
+    }
+    uint32_t mask = frame_order_map & (0xFFFFFFFF << order);
+    if (mask == 0) {
+        // Out of memory, the pages cleared ahead of time are still good pages
+        if (order == 0 && frame_zero_count != 0) {
+            return frame_zero_pool[--frame_zero_count];
+        }
+        return FRAME_NONE;
+    }
+
+    uint32_t found = LOBIT(mask);
+    return frame_take(frame_free_lists[found], found, order);
+}
+
+// Allocate 2^order contiguous frames that all lie below 'limit', for devices
+// that cannot address all of memory. Walks the free lists, so it is meant for
+// boot time and other rare callers.
+uint32_t frame_alloc_below(uint32_t order, uint64_t limit) {
+    for (uint32_t found = order; found <= FRAME_MAX_ORDER; found++) {
+        for (uint32_t pfn = frame_free_lists[found]; pfn != FRAME_NIL; pfn = frame_info[pfn].next) {
+            if (((uint64_t)(pfn + (1 << order)) << FRAME_SHIFT) <= limit) {
+                return frame_take(pfn, found, order);
+            }
+        }
+    }
+    return FRAME_NONE;
+}
+
+void frame_free(uint32_t phys_addr, uint32_t order) {
+    uint32_t pfn = phys_addr >> FRAME_SHIFT;
+    if (phys_addr == FRAME_NONE || pfn >= frame_count || order > FRAME_MAX_ORDER) {
+        return;
+    }
+    if (frame_info[pfn].flags & FRAME_FLAG_FREE) {
+        terminal_printf("Warning: Double free of frame 0x%x\n", phys_addr);
+        return;
+    }
+    frames_free += 1 << order;
+    frame_free_block(pfn, order);
+}
+
+// Allocate exactly 'count' contiguous frames, the rest of the buddy block goes back
+uint32_t frame_alloc_pages(uint32_t count) {
+    uint32_t order = frame_order_for((size_t)count << FRAME_SHIFT);
+    uint32_t phys = frame_alloc(order);
+    if (phys != FRAME_NONE && count < (1u << order)) {
+        uint32_t pfn = phys >> FRAME_SHIFT;
+        frame_free_range(pfn + count, pfn + (1 << order));
+    }
+    return phys;
+}
+
+// Free a run from frame_alloc_pages, as the largest aligned blocks it splits into
+void frame_free_pages(uint32_t phys_addr, uint32_t count) {
+    uint32_t pfn = phys_addr >> FRAME_SHIFT;
+    if (phys_addr == FRAME_NONE || count == 0 || pfn + count > frame_count) {
+        return;
+    }
+    if (frame_info[pfn].flags & FRAME_FLAG_FREE) {
+        terminal_printf("Warning: Double free of frame 0x%x\n", phys_addr);
+        return;
+    }
+    frame_free_range(pfn, pfn + count);
+}
+
+// Slide the run inside a block with room for every starting color, the
+// frames in front of and behind it go back to the free lists
+uint32_t frame_alloc_colored(uint32_t count, uint32_t color) {
+    if (count == 0) {
+        return FRAME_NONE;
+    }
+    if (color == FRAME_COLOR_NEXT) {
+        color = frame_color_next;
+    }
+    color &= frame_colors - 1;
+
+    uint32_t order = frame_order_for((size_t)(count + frame_colors - 1) << FRAME_SHIFT);
+    uint32_t phys = frame_alloc(order);
+    if (phys == FRAME_NONE) {
+        return frame_alloc_pages(count); // Tight on memory, any color will do
+    }
+
+    uint32_t pfn = phys >> FRAME_SHIFT;
+    uint32_t first = pfn + ((color - pfn) & (frame_colors - 1));
+    frame_free_range(pfn, first);
+    frame_free_range(first + count, pfn + (1 << order));
+    frame_color_next = (color + count) & (frame_colors - 1);
+    return first << FRAME_SHIFT;
+}
+
+uint32_t frame_order_for(size_t size) {
+    uint32_t pages = (size + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    if (pages <= 1) {
+        return 0;
+    }
+    return HIBIT(pages - 1) + 1;
+}
+
+uint32_t frame_free_count() {
+    return frames_free;
+}
+
+uint32_t frame_total_count() {
+    return frames_usable;
+}
+
+uint32_t frame_span() {
+    return frame_count;
+}
+
+// ---------------------------------------------------------------------------
+// Zeroed page pool
+//
+// Page tables and other zero-initialised pages are taken from a small pool
+// of frames cleared ahead of time, so the 4 KiB clear happens in the idle
+// loop instead of on the allocation path. Only the kernel thread touches the
+// pool, interrupt handlers do not allocate pages.
+// ---------------------------------------------------------------------------
+uint32_t frame_alloc_zeroed() {
+    if (frame_zero_count != 0) {
+        frame_zero_hits++;
+        return frame_zero_pool[--frame_zero_count];
+    }
+
+    frame_zero_misses++;
+    uint32_t phys = frame_alloc_page();
+    if (phys != FRAME_NONE) {
+        // Demand faults and their page tables land here when the pool is dry
+        memset_nosse((void *)phys, 0, FRAME_SIZE);
+    }
+    return phys;
+}
+
+// Clear up to 'budget' pages into the pool, returns how many were added
+uint32_t frame_zero_refill(uint32_t budget) {
+    uint32_t added = 0;
+    while (added < budget && frame_zero_count < FRAME_ZERO_POOL_SIZE) {
+        uint32_t phys = frame_alloc_page();
+        if (phys == FRAME_NONE) {
+            break;
+        }
+        memset((void *)phys, 0, FRAME_SIZE);
+        frame_zero_pool[frame_zero_count++] = phys;
+        ++added;
+    }
+    return added;
+}
+
+void frame_zero_stats(uint32_t *hits, uint32_t *misses, uint32_t *pooled) {
+    *hits = frame_zero_hits;
+    *misses = frame_zero_misses;
+    *pooled = frame_zero_count;
+}
@@ -12,10 +12,12 @@
 #include "svga.h"
 #include "pic_irq.h"
 #include "paging.h"
+#include "vmap.h"
 #include "apic_irq.h"
 #include "pic.h"
 #include "apic.h"
 #include "acpi.h"
+#include "arena.h"
 #include "io.h"
 #include <stdint.h>
 
@@ -107,8 +109,28 @@ uint32_t HAL_Initialize(multiboot_info_t *multiboot_info_addr) {
         }
         tag = (multiboot_tag_t *)((uint8_t *)tag+((tag->size + 7)&~7)); // Adjusted to have (uint8_t *) and altered byte aligment
     }
+    // Everything parsed from the boot tables is in place, nothing more goes in
+    arena_seal(&boot_arena);
     ACPI_DISABLE(); // Maybe not yet.....
-    // paging_init();
+    paging_init();
+
+    // The framebuffer sits at the start of a naturally aligned BAR, so when it
+    // starts on a 4 MiB boundary the whole 4 MiB page is the card's. Pixels
+    // go through write-combining, so blits leave as burst writes instead of
+    // one uncached store each. Text mode buffers are in low memory and
+    // already mapped. From here on the common tag holds the mapping, the
+    // full tag still has where the card put it.
+    uint32_t fb_base = (uint32_t)fbo_com_gb.framebuffer_addr;
+    uint32_t fb_size = fbo_com_gb.framebuffer_pitch * fbo_com_gb.framebuffer_height;
+    if (fb_base != 0 && fbo_com_gb.framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT) {
+        if ((fb_base & (PAGING_LARGE_PAGE_SIZE - 1)) == 0) {
+            fb_size = (fb_size + PAGING_LARGE_PAGE_SIZE - 1) & ~(PAGING_LARGE_PAGE_SIZE - 1);
+        }
+        void *fb_virt = ioremap_cache(fb_base, fb_size, CACHE_WC);
+        if (fb_virt != (void *)0xFFFFFFFF) {
+            fbo_com_gb.framebuffer_addr = (uint32_t)fb_virt;
+        }
+    }
     if (apic_enablable() != 0) {
         PIC_IRQ_Initialize();
         PIC_Disable();    // He didn't even live for a second man poor guy
@@ -136,10 +158,13 @@ uint32_t HAL_Initialize(multiboot_info_t *multiboot_info_addr) {
     STI();
     terminal_writestring("STI-ed\n");
     HPET_Initialize();
+    if (apic_enablable() == 0) {
+        // Better than the PIT, and it takes over IRQ 0 from it
+        HPET_ClockeventInitialize();
+    }
     terminal_writestring("Doing Something\n");
     pit_prepare_sleep(20000);
     pit_perform_sleep();
-    // paging_init();
     terminal_writestring("Something Done!!\n");
     // RenderFrame0();
     return eflagerrs;
@@ -1,8 +1,10 @@
 #include "hpet.h"
 #include "paging.h"
+#include "vmap.h"
 #include "timer.h"
+#include "clockevent.h"
 #include "memory.h"
-#include "io.h"       // for ioremap_nocache(), inb(), outb(), inl(), outl()
+#include "io.h"       // for inb(), outb(), inl(), outl()
 #include "terminal.h" // for terminal_printf()
 #include "acpi.h"
 #include <stdint.h>
@@ -25,8 +27,8 @@ void HPET_Initialize() {
     
     if (space == 0) {
         // Memory-mapped: map physical HPET registers.
-        hpet_virt_addr = (volatile void *)hpet_base_address;
-        if (!hpet_virt_addr) {
+        hpet_virt_addr = ioremap_nocache(hpet_base_address, PAGING_PAGE_SIZE);
+        if (hpet_virt_addr == (void *)0xFFFFFFFF) {
             terminal_printf("Failed to map HPET registers!\n");
             return;
         }
@@ -36,8 +38,8 @@ void HPET_Initialize() {
         hpet_io_port = hpet_base_address;
         terminal_printf("HPET registers accessed via I/O port: 0x%x\n", (uint32_t)hpet_io_port);
     } else {
-        hpet_virt_addr = (volatile void *)hpet_base_address;
-        if (!hpet_virt_addr) {
+        hpet_virt_addr = ioremap_nocache(hpet_base_address, PAGING_PAGE_SIZE);
+        if (hpet_virt_addr == (void *)0xFFFFFFFF) {
             terminal_printf("Failed to map HPET registers!\n");
             return;
         }
@@ -152,3 +154,58 @@ void HPET_IncrementValueAtInterval(uint32_t interval_ticks) {
         }
     }
 }
+
+// ---------------------------------------------------------------------------
+// Clock events
+//
+// Timer 0 in one-shot mode, delivered on IRQ 0 through legacy replacement
+// routing, which the PIT had until now. Only for machines without a local
+// APIC, which have nothing better.
+// ---------------------------------------------------------------------------
+static uint32_t hpet_ns_mult = 0;       // Nanoseconds to HPET ticks, shift 32
+
+static bool HPET_ClockeventSetNext(uint64_t delta_ns) {
+    uint64_t ticks = clock_scale(delta_ns, hpet_ns_mult, 32);
+    uint64_t start = HPET_ReadCounter();
+    uint64_t target = start + ticks;
+    HPET_WriteIO(HPET_TIMER_COMPARATOR, (uint32_t)target);
+    HPET_WriteIO(HPET_TIMER_COMPARATOR + 4, (uint32_t)(target >> 32));
+    HPET_WriteIO(HPET_TIMER_CONFIG, HPET_ReadIO(HPET_TIMER_CONFIG) | HPET_TIMER_INT_ENABLE);
+    // The comparator only matches on equality, a target the counter is
+    // already past would wait for it to wrap
+    return HPET_ReadCounter() - start < ticks;
+}
+
+static void HPET_ClockeventStop() {
+    HPET_WriteIO(HPET_TIMER_CONFIG, HPET_ReadIO(HPET_TIMER_CONFIG) & ~HPET_TIMER_INT_ENABLE);
+}
+
+static clockevent_device_t hpet_clockevent_device = {
+    .name = "HPET one-shot",
+    .rating = 200,
+    .min_delta_ns = 5000,               // A few slow register accesses
+    .max_delta_ns = CLOCK_NS_PER_SEC,
+    .set_next = HPET_ClockeventSetNext,
+    .stop = HPET_ClockeventStop,
+};
+
+void HPET_ClockeventInitialize() {
+    if (hpet_data->base_address.AddressSpace != 1 &&
+            (hpet_virt_addr == NULL || hpet_virt_addr == (void *)0xFFFFFFFF)) {
+        return;
+    }
+    uint64_t capabilities = HPET_ReadCapabilities();
+    uint32_t hpet_period_fs = (uint32_t)(capabilities >> 32);
+    if (hpet_period_fs == 0 || !(capabilities & HPET_LEGACY_ROUTE_CAPABLE)) {
+        return;
+    }
+    hpet_ns_mult = (uint32_t)clock_div(1000000ULL << 32, hpet_period_fs);
+
+    // Edge triggered, one-shot, 64-bit, interrupt off until armed
+    uint32_t config = HPET_ReadIO(HPET_TIMER_CONFIG);
+    config &= ~(HPET_TIMER_INT_ENABLE | HPET_TIMER_LEVEL | HPET_TIMER_PERIODIC | HPET_TIMER_32BIT);
+    HPET_WriteIO(HPET_TIMER_CONFIG, config);
+    HPET_WriteIO(HPET_GENERAL_CONFIGURATION,
+        HPET_ReadIO(HPET_GENERAL_CONFIGURATION) | HPET_ENABLE_BIT | HPET_LEGACY_ROUTE);
+    clockevent_register(&hpet_clockevent_device);
+}
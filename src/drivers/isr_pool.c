@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "isr_pool.h"
+#include "memory.h"
+#include "terminal.h"
+#include "io.h"
+
+isr_pool_t *irq_buffer_pool = NULL;
+static isr_pool_t *isr_pools = NULL;
+
+// ---------------------------------------------------------------------------
+// Lock-free stacks
+//
+// A free object holds the address of the next one in its first word. The
+// head is read in two halves, which is fine: a torn read only makes the
+// swap fail, and the next pointer it loaded came out of pool memory, which
+// is always mapped even when the object is no longer free.
+// ---------------------------------------------------------------------------
+static void isr_stack_push(isr_stack_t *stack, void *object) {
+    uint64_t old = stack->head;
+    uint64_t new;
+    do {
+        *(volatile uint32_t *)object = (uint32_t)old;
+        new = (((old >> 32) + 1) << 32) | (uint32_t)(uintptr_t)object;
+    } while (!atomic_cas64(&stack->head, &old, new));
+}
+
+static void *isr_stack_pop(isr_stack_t *stack) {
+    uint64_t old = stack->head;
+    uint64_t new;
+    do {
+        uint32_t top = (uint32_t)old;
+        if (top == 0) {
+            return NULL;
+        }
+        uint32_t next = *(volatile uint32_t *)(uintptr_t)top;
+        new = (((old >> 32) + 1) << 32) | next;
+    } while (!atomic_cas64(&stack->head, &old, new));
+    return (void *)(uintptr_t)(uint32_t)old;
+}
+
+// ---------------------------------------------------------------------------
+// Pools
+// ---------------------------------------------------------------------------
+void isr_pool_initialize() {
+    irq_buffer_pool = isr_pool_create("irq buffers", IRQ_BUFFER_SIZE, IRQ_BUFFER_COUNT);
+    if (irq_buffer_pool == NULL) {
+        terminal_printf("Warning: No room for the IRQ buffer pool.\n");
+    }
+}
+
+isr_pool_t *isr_pool_create(const char *name, size_t object_size, uint32_t count) {
+    if (count == 0) {
+        return NULL;
+    }
+    // Room for the free list link, and keep objects 8-byte aligned
+    object_size = (MAX(object_size, sizeof(uint32_t)) + 7) & ~(size_t)7;
+
+    isr_pool_t *pool = memalloc_tagged(sizeof(isr_pool_t), MEM_TAG_KERNEL);
+    if (pool == (void *)0xFFFFFFFF) {
+        return NULL;
+    }
+    uint8_t *objects = memalloc_tagged(object_size * count + count, MEM_TAG_KERNEL);
+    if (objects == (void *)0xFFFFFFFF) {
+        memfree(pool);
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(isr_pool_t));
+    pool->name = name;
+    pool->object_size = object_size;
+    pool->count = count;
+    pool->objects = objects;
+    pool->owner = objects + object_size * count;
+    memset(pool->owner, 0, count);
+
+    // Push from the back, so the first allocations come out front to back
+    for (uint32_t i = count; i-- > 0;) {
+        isr_stack_push(&pool->free, objects + i * object_size);
+    }
+
+    pool->next = isr_pools;
+    isr_pools = pool;
+    return pool;
+}
+
+// Move 'count' shared objects over to a reserve for 'vector'
+bool isr_pool_reserve(isr_pool_t *pool, uint32_t vector, uint32_t count) {
+    isr_reserve_t *reserve = NULL;
+    uint32_t index;
+    for (index = 0; index < pool->reserve_count; index++) {
+        if (pool->reserves[index].vector == vector) {
+            reserve = &pool->reserves[index];
+            break;
+        }
+    }
+    if (reserve == NULL) {
+        if (pool->reserve_count == ISR_POOL_MAX_RESERVES) {
+            return false;
+        }
+        reserve = &pool->reserves[pool->reserve_count];
+        reserve->vector = vector;
+        reserve->count = 0;
+        reserve->free.head = 0;
+        pool->reserve_count++;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *object = isr_stack_pop(&pool->free);
+        if (object == NULL) {
+            return false;
+        }
+        pool->owner[(object - pool->objects) / pool->object_size] = index + 1;
+        isr_stack_push(&reserve->free, object);
+        reserve->count++;
+    }
+    return true;
+}
+
+void *isr_pool_alloc(isr_pool_t *pool, uint32_t vector) {
+    void *object = isr_stack_pop(&pool->free);
+    if (object == NULL && vector != ISR_POOL_ANY_VECTOR) {
+        for (uint32_t i = 0; i < pool->reserve_count; i++) {
+            if (pool->reserves[i].vector == vector) {
+                object = isr_stack_pop(&pool->reserves[i].free);
+                if (object != NULL) {
+                    atomic_add(&pool->reserve_allocs, 1);
+                }
+                break;
+            }
+        }
+    }
+    if (object == NULL) {
+        atomic_add(&pool->failed, 1);
+        return (void *)0xFFFFFFFF;
+    }
+
+    uint32_t in_use = atomic_add(&pool->in_use, 1) + 1;
+    uint32_t high = pool->high_watermark;
+    while (in_use > high && !atomic_cas(&pool->high_watermark, &high, in_use));
+    return object;
+}
+
+void isr_pool_free(isr_pool_t *pool, void *object) {
+    if (object == NULL || object == (void *)0xFFFFFFFF) {
+        return;
+    }
+    uint8_t owner = pool->owner[((uint8_t *)object - pool->objects) / pool->object_size];
+    atomic_add(&pool->in_use, (uint32_t)-1);
+    if (owner == 0) {
+        isr_stack_push(&pool->free, object);
+    } else {
+        isr_stack_push(&pool->reserves[owner - 1].free, object);
+    }
+}
+
+void isr_pool_print_stats() {
+    for (isr_pool_t *pool = isr_pools; pool != NULL; pool = pool->next) {
+        terminal_printf("  %s: %u B objects, %u in use of %u, high %u, %u from reserves, %u failed\n",
+            pool->name, pool->object_size, pool->in_use, pool->count, pool->high_watermark,
+            pool->reserve_allocs, pool->failed);
+        for (uint32_t i = 0; i < pool->reserve_count; i++) {
+            terminal_printf("    reserve for vector 0x%x: %u objects\n",
+                pool->reserves[i].vector, pool->reserves[i].count);
+        }
+    }
+}
@@ -9,6 +9,7 @@
 #include "pic.h"
 #include "apic.h"
 #include "io.h"
+#include "isr_pool.h"
 
 #define KEYBOARD_IRQ_VECTOR         1
 #define KEYBOARD_INTERRUPT_VECTOR   0x21
@@ -20,6 +21,11 @@
 #define IOAPIC_DESTINATION    0x00000000  // Send to all CPUs (this is usually specific for SMP systems)
 
 keyboard_t keyboard;
+
+// The handler pushes onto 'keyboard_pending', newest first. The reader takes
+// the whole list at once and keeps it oldest first in 'keyboard_ready'.
+static volatile uint32_t keyboard_pending = 0;
+static keyboard_event_t *keyboard_ready = NULL;
 const uint8_t keyboard_layout_us[2][128] = {
     {
         KEY_NULL, KEY_ESC, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0',
@@ -160,6 +166,22 @@ void keyboard_handler(Registers *regs) {
 
     bool was_on = keyboard.chars[KEY_CHAR(scancode|keyboard.mods)];
 
+    keyboard_event_t *event = (void *)0xFFFFFFFF;
+    if (irq_buffer_pool != NULL) {
+        event = isr_pool_alloc(irq_buffer_pool, KEYBOARD_INTERRUPT_VECTOR);
+    }
+    if (event != (void *)0xFFFFFFFF) {
+        event->scancode = scancode;
+        event->mods = keyboard.mods;
+        event->key_char = KEY_CHAR(scancode|keyboard.mods);
+        event->pressed = KEY_IS_PRESS(scancode);
+
+        uint32_t head = keyboard_pending;
+        do {
+            event->next = (keyboard_event_t *)(uintptr_t)head;
+        } while (!atomic_cas(&keyboard_pending, &head, (uint32_t)(uintptr_t)event));
+    }
+
     // Update key state
     keyboard.keys[(uint8_t)(scancode & 0x7F)] = KEY_IS_PRESS(scancode);
     keyboard.chars[KEY_CHAR(scancode|keyboard.mods)] = KEY_IS_PRESS(scancode);
@@ -173,13 +195,49 @@ void keyboard_handler(Registers *regs) {
     }
 }
 
+// Copy out the oldest queued event, false if there is none
+bool keyboard_read_event(keyboard_event_t *event) {
+    if (keyboard_ready == NULL) {
+        keyboard_event_t *pending = (keyboard_event_t *)(uintptr_t)atomic_xchg(&keyboard_pending, 0);
+        while (pending != NULL) {
+            keyboard_event_t *next = pending->next;
+            pending->next = keyboard_ready;
+            keyboard_ready = pending;
+            pending = next;
+        }
+        if (keyboard_ready == NULL) {
+            return false;
+        }
+    }
+
+    keyboard_event_t *oldest = keyboard_ready;
+    keyboard_ready = oldest->next;
+    *event = *oldest;
+    event->next = NULL;
+    isr_pool_free(irq_buffer_pool, oldest);
+    return true;
+}
+
+// Whether keyboard_read_event would return something, without taking it
+bool keyboard_has_event() {
+    return keyboard_ready != NULL || keyboard_pending != 0;
+}
+
+static void keyboard_reserve_events() {
+    if (irq_buffer_pool != NULL) {
+        isr_pool_reserve(irq_buffer_pool, KEYBOARD_INTERRUPT_VECTOR, KEYBOARD_EVENT_RESERVE);
+    }
+}
+
 void keyboard_pic_init() {
+    keyboard_reserve_events();
     PIC_IRQ_RegisterHandler(1, (IRQHandler)keyboard_handler);
     PIC_Unmask(1);
     terminal_printf("PIC Keyboard IRQ Initialized\n");
 }
 
 void keyboard_apic_init() {
+    keyboard_reserve_events();
     APIC_IRQ_RegisterHandler(1, (IRQHandler)keyboard_handler);
     IOAPIC_ConfigureKeyboard();
     // terminal_printf("Keyboard Interrupt configuration complete!\n");
@@ -0,0 +1,572 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "memory.h"
+#include "terminal.h"
+#include "hpet.h"
+#include "io.h"
+
+#define MEMOPS_SSE_MIN       128           // Below this the SSE setup costs more than it saves
+#define MEMOPS_NT_THRESHOLD  (256 * 1024)  // Bigger copies/fills bypass the cache
+
+typedef void *(*memcpy_fn_t)(void *dest, const void *src, size_t n);
+typedef void *(*memset_fn_t)(void *ptr, int value, size_t n);
+
+static void *memcpy_movsd(void *dest, const void *src, size_t n);
+static void *memset_stosd(void *ptr, int value, size_t n);
+
+// Picked by memory_select_ops(), the rep movsd/stosd versions work on any 386
+static memcpy_fn_t memcpy_impl = memcpy_movsd;
+static memset_fn_t memset_impl = memset_stosd;
+static const char *memops_name = "rep movsd";
+static uint8_t memops_sse2 = 0;
+
+int8_t memcmp(const char *str1, const char *str2, size_t n) {
+    while (n-- > 0) {
+        if (*str1 != *str2) {
+            return (unsigned char)(*str1) - (unsigned char)(*str2);
+        }
+        str1++;
+        str2++;
+    }
+    return 0;  // Return 0 if strings are equal up to n characters
+}
+
+// ---------------------------------------------------------------------------
+// Byte loops
+//
+// The original implementations, kept as the reference for the self check and
+// the baseline for the benchmark.
+// ---------------------------------------------------------------------------
+static void *memcpy_bytes(void *dest, const void *src, size_t n) {
+    volatile unsigned char *d = dest;
+    const unsigned char *s = src;
+    while (n--) {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+static void *memset_bytes(void *ptr, int value, size_t n) {
+    volatile unsigned char *p = ptr;
+    while (n--) {
+        *p++ = (unsigned char)value;
+    }
+    return ptr;
+}
+
+static void *memset_pattern_bytes(void *ptr, const void *pattern, size_t pattern_size, size_t num) {
+    volatile unsigned char *p = (unsigned char *)ptr;
+    const unsigned char *pat = (const unsigned char *)pattern;
+    size_t pat_idx = 0;
+
+    for (size_t i = 0; i < num; ++i) {
+        p[i] = pat[pat_idx];
+        pat_idx = (pat_idx + 1) % pattern_size;
+    }
+
+    return ptr;
+}
+
+// ---------------------------------------------------------------------------
+// String instructions
+//
+// rep movsd/stosd move a dword per step after the destination is aligned.
+// With ERMS (enhanced rep movsb/stosb) the microcode picks its own chunk
+// size, so the byte forms are as fast and need no head/tail handling.
+// ---------------------------------------------------------------------------
+static void *memcpy_movsd(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    size_t head = MIN((size_t)(-(uintptr_t)dest & 3), n);
+    size_t dwords = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+
+    asm("cld\n\t"
+        "rep movsb\n\t"
+        "mov %3, %2\n\t"
+        "rep movsl\n\t"
+        "mov %4, %2\n\t"
+        "rep movsb"
+        : "+D"(d), "+S"(src), "+c"(head)
+        : "r"(dwords), "r"(tail)
+        : "memory");
+    return dest;
+}
+
+static void *memset_stosd(void *ptr, int value, size_t n) {
+    void *p = ptr;
+    uint32_t fill = (uint32_t)(uint8_t)value * 0x01010101;
+    size_t head = MIN((size_t)(-(uintptr_t)ptr & 3), n);
+    size_t dwords = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+
+    asm("cld\n\t"
+        "rep stosb\n\t"
+        "mov %3, %1\n\t"
+        "rep stosl\n\t"
+        "mov %4, %1\n\t"
+        "rep stosb"
+        : "+D"(p), "+c"(head)
+        : "a"(fill), "r"(dwords), "r"(tail)
+        : "memory");
+    return ptr;
+}
+
+static void *memcpy_erms(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    asm("cld; rep movsb" : "+D"(d), "+S"(src), "+c"(n) :: "memory");
+    return dest;
+}
+
+static void *memset_erms(void *ptr, int value, size_t n) {
+    void *p = ptr;
+    asm("cld; rep stosb" : "+D"(p), "+c"(n) : "a"(value) : "memory");
+    return ptr;
+}
+
+// Copy downwards for overlapping moves where dest is above src
+static void *memmove_backward(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest + n - 1;
+    const uint8_t *s = (const uint8_t *)src + n - 1;
+    size_t tail = n & 3;
+
+    asm("std\n\t"
+        "rep movsb\n\t"
+        "sub $3, %0\n\t"
+        "sub $3, %1\n\t"
+        "mov %3, %2\n\t"
+        "rep movsl\n\t"
+        "cld"
+        : "+D"(d), "+S"(s), "+c"(tail)
+        : "r"(n >> 2)
+        : "memory");
+    return dest;
+}
+
+// ---------------------------------------------------------------------------
+// SSE2
+//
+// 64 bytes per iteration through xmm0-3 with aligned stores. Past
+// MEMOPS_NT_THRESHOLD the stores are non-temporal so a big copy does not
+// evict the whole cache, followed by an sfence to order them with later
+// stores. The ISR stubs do not save the SSE state; interrupt handlers only
+// ever copy a few bytes, which stays below MEMOPS_SSE_MIN, and the page
+// fault path clears whole pages through memset_nosse.
+// ---------------------------------------------------------------------------
+__attribute__((target("sse2")))
+static void *memcpy_sse2(void *dest, const void *src, size_t n) {
+    if (n < MEMOPS_SSE_MIN) {
+        return memcpy_movsd(dest, src, n);
+    }
+
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t head = -(uintptr_t)d & 15;
+    memcpy_movsd(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n >> 6;
+    if (n >= MEMOPS_NT_THRESHOLD) {
+        for (; blocks; --blocks, s += 64, d += 64) {
+            asm("movdqu   (%1), %%xmm0\n\t"
+                "movdqu 16(%1), %%xmm1\n\t"
+                "movdqu 32(%1), %%xmm2\n\t"
+                "movdqu 48(%1), %%xmm3\n\t"
+                "movntdq %%xmm0,   (%0)\n\t"
+                "movntdq %%xmm1, 16(%0)\n\t"
+                "movntdq %%xmm2, 32(%0)\n\t"
+                "movntdq %%xmm3, 48(%0)"
+                :: "r"(d), "r"(s) : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+        }
+        asm("sfence" ::: "memory");
+    } else {
+        for (; blocks; --blocks, s += 64, d += 64) {
+            asm("movdqu   (%1), %%xmm0\n\t"
+                "movdqu 16(%1), %%xmm1\n\t"
+                "movdqu 32(%1), %%xmm2\n\t"
+                "movdqu 48(%1), %%xmm3\n\t"
+                "movdqa %%xmm0,   (%0)\n\t"
+                "movdqa %%xmm1, 16(%0)\n\t"
+                "movdqa %%xmm2, 32(%0)\n\t"
+                "movdqa %%xmm3, 48(%0)"
+                :: "r"(d), "r"(s) : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+        }
+    }
+
+    memcpy_movsd(d, s, n & 63);
+    return dest;
+}
+
+__attribute__((target("sse2")))
+static void *memset_sse2(void *ptr, int value, size_t n) {
+    if (n < MEMOPS_SSE_MIN) {
+        return memset_stosd(ptr, value, n);
+    }
+
+    uint8_t *p = ptr;
+    size_t head = -(uintptr_t)p & 15;
+    memset_stosd(p, value, head);
+    p += head;
+    n -= head;
+
+    // Broadcast the byte to all 16 lanes of xmm0, then store 64 bytes a round
+    size_t blocks = n >> 6;
+    uint32_t fill = (uint32_t)(uint8_t)value * 0x01010101;
+    if (n >= MEMOPS_NT_THRESHOLD) {
+        asm("movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm0, 16(%0)\n\t"
+            "movntdq %%xmm0, 32(%0)\n\t"
+            "movntdq %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(p), "+r"(blocks) : "r"(fill) : "memory", "xmm0");
+    } else {
+        asm("movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movdqa %%xmm0,   (%0)\n\t"
+            "movdqa %%xmm0, 16(%0)\n\t"
+            "movdqa %%xmm0, 32(%0)\n\t"
+            "movdqa %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b"
+            : "+r"(p), "+r"(blocks) : "r"(fill) : "memory", "xmm0");
+    }
+
+    memset_stosd(p, value, n & 63);
+    return ptr;
+}
+
+// ---------------------------------------------------------------------------
+// Pattern fills
+//
+// Pixels are 1 to 4 bytes, and 48 bytes hold a whole number of every pixel
+// size as well as three 16 byte stores. After aligning the destination the
+// pattern is unrolled once into a 48 byte line at the right phase, which is
+// then stored over and over. The line also supplies the tail since the
+// phase is back at the start after every 48 bytes.
+// ---------------------------------------------------------------------------
+#define MEMOPS_PATTERN_LINE  48
+
+__attribute__((target("sse2")))
+static void memset_line_sse2(uint8_t *p, const uint32_t *line, size_t lines, uint8_t stream) {
+    if (stream) {
+        asm("movdqa   (%2), %%xmm0\n\t"
+            "movdqa 16(%2), %%xmm1\n\t"
+            "movdqa 32(%2), %%xmm2\n\t"
+            "1:\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm1, 16(%0)\n\t"
+            "movntdq %%xmm2, 32(%0)\n\t"
+            "add $48, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(p), "+r"(lines) : "r"(line) : "memory", "xmm0", "xmm1", "xmm2");
+    } else {
+        asm("movdqa   (%2), %%xmm0\n\t"
+            "movdqa 16(%2), %%xmm1\n\t"
+            "movdqa 32(%2), %%xmm2\n\t"
+            "1:\n\t"
+            "movdqa %%xmm0,   (%0)\n\t"
+            "movdqa %%xmm1, 16(%0)\n\t"
+            "movdqa %%xmm2, 32(%0)\n\t"
+            "add $48, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b"
+            : "+r"(p), "+r"(lines) : "r"(line) : "memory", "xmm0", "xmm1", "xmm2");
+    }
+}
+
+static void *memset_pattern_wide(void *ptr, const uint8_t *pattern, size_t pattern_size, size_t num, uint8_t stream) {
+    uint8_t *p = ptr;
+    size_t phase = 0;
+
+    // Bytes up to the first 16 byte boundary
+    for (size_t head = MIN((size_t)(-(uintptr_t)p & 15), num); head; --head, --num) {
+        *p++ = pattern[phase];
+        if (++phase == pattern_size) {
+            phase = 0;
+        }
+    }
+
+    uint32_t line[MEMOPS_PATTERN_LINE / 4] __attribute__((aligned(16)));
+    uint8_t *line_bytes = (uint8_t *)line;
+    for (size_t i = 0; i < MEMOPS_PATTERN_LINE; i++) {
+        line_bytes[i] = pattern[phase];
+        if (++phase == pattern_size) {
+            phase = 0;
+        }
+    }
+
+    size_t lines = num / MEMOPS_PATTERN_LINE;
+    if (lines != 0 && memops_sse2 && num >= MEMOPS_SSE_MIN) {
+        memset_line_sse2(p, line, lines, stream);
+    } else {
+        uint32_t *w = (uint32_t *)p;
+        for (size_t i = 0; i < lines; i++, w += MEMOPS_PATTERN_LINE / 4) {
+            w[0] = line[0]; w[1] = line[1]; w[2]  = line[2];  w[3]  = line[3];
+            w[4] = line[4]; w[5] = line[5]; w[6]  = line[6];  w[7]  = line[7];
+            w[8] = line[8]; w[9] = line[9]; w[10] = line[10]; w[11] = line[11];
+        }
+    }
+    p += lines * MEMOPS_PATTERN_LINE;
+    num -= lines * MEMOPS_PATTERN_LINE;
+
+    for (size_t i = 0; i < num; i++) {
+        p[i] = line_bytes[i];
+    }
+    return ptr;
+}
+
+void *memset_pattern(void *ptr, const void *pattern, size_t pattern_size, size_t num) {
+    if (pattern_size == 1) {
+        return memset_impl(ptr, *(const uint8_t *)pattern, num);
+    }
+    if (pattern_size == 0 || pattern_size > 4) {
+        return pattern_size ? memset_pattern_bytes(ptr, pattern, pattern_size, num) : ptr;
+    }
+    return memset_pattern_wide(ptr, pattern, pattern_size, num, 0);
+}
+
+// Same, but large fills bypass the cache. For write-only targets like the framebuffer
+void *memset_pattern_stream(void *ptr, const void *pattern, size_t pattern_size, size_t num) {
+    if (pattern_size == 0 || pattern_size > 4) {
+        return pattern_size ? memset_pattern_bytes(ptr, pattern, pattern_size, num) : ptr;
+    }
+    return memset_pattern_wide(ptr, pattern, pattern_size, num, 1);
+}
+
+// ---------------------------------------------------------------------------
+// Dispatch
+// ---------------------------------------------------------------------------
+void memory_select_ops() {
+    uint32_t max_leaf, eax, ebx, ecx, edx;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    uint8_t sse2 = (edx & CPUID_1_EDX_SSE2) != 0;
+
+    uint8_t erms = 0;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+    }
+
+    // SSE2 wins on big copies thanks to the streaming stores, ERMS is the
+    // best of the cached forms when there is no SSE2
+    memops_sse2 = sse2;
+    if (sse2) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+        memops_name = "sse2";
+    } else if (erms) {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+        memops_name = "rep movsb (erms)";
+    }
+    terminal_printf("Memory ops: %s\n", memops_name);
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    return memcpy_impl(dest, src, n);
+}
+
+void *memset_nosse(void *ptr, int value, size_t num) {
+    return memset_stosd(ptr, value, num);
+}
+
+void *memset(void *ptr, int value, size_t num) {
+    return memset_impl(ptr, value, num);
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    // Copying forwards is safe unless dst starts inside src
+    if ((uintptr_t)dst - (uintptr_t)src >= n) {
+        return memcpy_impl(dst, src, n);
+    }
+    return memmove_backward(dst, src, n);
+}
+
+// ---------------------------------------------------------------------------
+// Self check and benchmark
+//
+// Every variant the CPU supports is checked against the byte loops over a
+// matrix of sizes, source/destination misalignments and overlaps, then timed
+// on a cached and a streaming sized buffer with the HPET.
+// ---------------------------------------------------------------------------
+#define MEMOPS_CHECK_SPAN    1024
+#define MEMOPS_BENCH_SMALL   (16 * 1024)
+#define MEMOPS_BENCH_LARGE   (1024 * 1024)
+#define MEMOPS_BENCH_SCREEN  (1024 * 768 * 4)  // The 32 bpp pixel clear
+#define MEMOPS_BENCH_BYTES   (16 * 1024 * 1024)   // Moved per timed run
+
+typedef struct {
+    const char *name;
+    memcpy_fn_t copy;
+    memset_fn_t set;
+    uint8_t available;
+} memops_variant_t;
+
+static void memops_fill(uint8_t *buffer, size_t n, uint32_t seed) {
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+static const size_t memops_check_sizes[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 15, 16, 17, 31, 32, 63, 64, 65, 127, 128, 129, 255, 256, 257, 511, 700
+};
+#define MEMOPS_CHECK_COUNT (sizeof(memops_check_sizes) / sizeof(memops_check_sizes[0]))
+
+// Returns the number of mismatches for one variant
+static uint32_t memops_check(memops_variant_t *variant, uint8_t *buffer, uint8_t *reference) {
+    uint32_t failures = 0;
+    for (uint32_t i = 0; i < MEMOPS_CHECK_COUNT; i++) {
+        size_t n = memops_check_sizes[i];
+        for (uint32_t src_off = 0; src_off < 16; src_off++) {
+            for (uint32_t dst_off = 0; dst_off < 16; dst_off++) {
+                // Copy between disjoint halves, bytes around dest must stay put
+                memops_fill(buffer, 2 * MEMOPS_CHECK_SPAN, n + src_off * 16 + dst_off);
+                memcpy_bytes(reference, buffer, 2 * MEMOPS_CHECK_SPAN);
+                variant->copy(buffer + MEMOPS_CHECK_SPAN + dst_off, buffer + src_off, n);
+                memcpy_bytes(reference + MEMOPS_CHECK_SPAN + dst_off, reference + src_off, n);
+                failures += memcmp((char *)buffer, (char *)reference, 2 * MEMOPS_CHECK_SPAN) != 0;
+
+                memset_bytes(reference + dst_off, 0xA5 ^ n, n);
+                variant->set(buffer + dst_off, 0xA5 ^ n, n);
+                failures += memcmp((char *)buffer, (char *)reference, 2 * MEMOPS_CHECK_SPAN) != 0;
+            }
+        }
+    }
+    return failures;
+}
+
+// Overlapping moves in both directions through the dispatched memmove
+static uint32_t memops_check_overlap(uint8_t *buffer, uint8_t *reference) {
+    uint32_t failures = 0;
+    for (uint32_t i = 0; i < MEMOPS_CHECK_COUNT; i++) {
+        size_t n = memops_check_sizes[i];
+        for (int32_t shift = -17; shift <= 17; shift++) {
+            size_t src = 64, dst = 64 + shift;
+            memops_fill(buffer, MEMOPS_CHECK_SPAN, n + shift);
+            memcpy_bytes(reference, buffer, MEMOPS_CHECK_SPAN);
+            memmove(buffer + dst, buffer + src, n);
+            if (shift > 0) {
+                for (size_t k = n; k > 0; k--) {
+                    reference[dst + k - 1] = reference[src + k - 1];
+                }
+            } else {
+                memcpy_bytes(reference + dst, reference + src, n);
+            }
+            failures += memcmp((char *)buffer, (char *)reference, MEMOPS_CHECK_SPAN) != 0;
+        }
+    }
+    return failures;
+}
+
+// Pattern fills of every pixel size against the byte loop
+static uint32_t memops_check_pattern(uint8_t *buffer, uint8_t *reference) {
+    uint32_t failures = 0;
+    const uint8_t pattern[5] = { 0x12, 0x34, 0x56, 0x78, 0x9A };
+    for (uint32_t size = 1; size <= 5; size++) {
+        for (uint32_t i = 0; i < MEMOPS_CHECK_COUNT; i++) {
+            size_t n = memops_check_sizes[i];
+            for (uint32_t off = 0; off < 16; off++) {
+                memops_fill(buffer, MEMOPS_CHECK_SPAN, n + off);
+                memcpy_bytes(reference, buffer, MEMOPS_CHECK_SPAN);
+                memset_pattern_bytes(reference + off, pattern, size, n);
+                if (off & 1) {
+                    memset_pattern_stream(buffer + off, pattern, size, n);
+                } else {
+                    memset_pattern(buffer + off, pattern, size, n);
+                }
+                failures += memcmp((char *)buffer, (char *)reference, MEMOPS_CHECK_SPAN) != 0;
+            }
+        }
+    }
+    return failures;
+}
+
+// MB/s for moving MEMOPS_BENCH_BYTES through a window of 'size' bytes
+static uint32_t memops_time(memops_variant_t *variant, uint8_t set, uint8_t *dest, uint8_t *src, size_t size) {
+    uint64_t start = HPET_ReadCounter();
+    for (uint32_t done = 0; done < MEMOPS_BENCH_BYTES; done += size) {
+        if (set) {
+            variant->set(dest, done, size);
+        } else {
+            variant->copy(dest, src, size);
+        }
+    }
+    float elapsed = (float)(HPET_ReadCounter() - start) / HPET_FREQ;
+    return elapsed > 0 ? (uint32_t)(MEMOPS_BENCH_BYTES / (1024 * 1024) / elapsed) : 0;
+}
+
+void memory_benchmark() {
+    uint32_t max_leaf, eax, ebx, ecx, edx;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    uint8_t sse2 = (edx & CPUID_1_EDX_SSE2) != 0;
+    uint8_t erms = 0;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+    }
+
+    memops_variant_t variants[] = {
+        { "bytes",      memcpy_bytes, memset_bytes, 1    },
+        { "rep movsd",  memcpy_movsd, memset_stosd, 1    },
+        { "rep movsb",  memcpy_erms,  memset_erms,  erms },
+        { "sse2",       memcpy_sse2,  memset_sse2,  sse2 },
+    };
+
+    uint8_t *buffer = mem_alloc_aligned(MAX(2 * MEMOPS_BENCH_LARGE, MEMOPS_BENCH_SCREEN), 64);
+    uint8_t *reference = memalloc(2 * MEMOPS_CHECK_SPAN);
+    if (buffer == (void *)0xFFFFFFFF || reference == (void *)0xFFFFFFFF) {
+        terminal_printf("Error: No memory for the benchmark buffers.\n");
+        memfree(buffer);
+        memfree(reference);
+        return;
+    }
+
+    terminal_printf("Memory ops in use: %s\n", memops_name);
+    terminal_printf("memmove overlap check: %u failures\n", memops_check_overlap(buffer, reference));
+    terminal_printf("memset_pattern check: %u failures\n", memops_check_pattern(buffer, reference));
+    terminal_printf("%s  check    copy 16K  copy 1M  set 16K  set 1M (MB/s)\n", "variant   ");
+    for (uint32_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        memops_variant_t *variant = &variants[i];
+        if (!variant->available) {
+            terminal_printf("%s  not supported\n", variant->name);
+            continue;
+        }
+        uint32_t failures = memops_check(variant, buffer, reference);
+        terminal_printf("%s  %u  %u  %u  %u  %u\n", variant->name, failures,
+            memops_time(variant, 0, buffer + MEMOPS_BENCH_LARGE, buffer, MEMOPS_BENCH_SMALL),
+            memops_time(variant, 0, buffer + MEMOPS_BENCH_LARGE, buffer, MEMOPS_BENCH_LARGE),
+            memops_time(variant, 1, buffer, NULL, MEMOPS_BENCH_SMALL),
+            memops_time(variant, 1, buffer, NULL, MEMOPS_BENCH_LARGE));
+    }
+
+
+    // A full 1024x768 clear, per pixel size, the buffer holds the 32 bpp one
+    for (uint32_t pixel = 2; pixel <= 4; pixel++) {
+        uint32_t color = 0x11223344;
+        uint64_t start = HPET_ReadCounter();
+        memset_pattern_bytes(buffer, &color, pixel, 1024 * 768 * pixel);
+        uint64_t middle = HPET_ReadCounter();
+        memset_pattern_stream(buffer, &color, pixel, 1024 * 768 * pixel);
+        uint64_t end = HPET_ReadCounter();
+        terminal_printf("%u byte pixel clear: %u us bytes, %u us wide\n", pixel,
+            (uint32_t)((float)(middle - start) * 1000000 / HPET_FREQ), (uint32_t)((float)(end - middle) * 1000000 / HPET_FREQ));
+    }
+
+    memfree(reference);
+    memfree(buffer);
+}
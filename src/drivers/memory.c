@@ -3,188 +3,371 @@
 #include "acpi.h"
 #include "terminal.h"
 #include "util.h"
+#include "frame.h"
+#include "io.h"
+#include "hpet.h"
+#include "arena.h"
+#include "paging.h"
+#include "tlb.h"
+#include "demand.h"
+#include "dma.h"
+#include "isr_pool.h"
 
 uint32_t heap_start = 0;
 uint32_t heap_end = 0;
 
-static block_header_t *free_list = (block_header_t *)0xFFFFFFFF; // Start with no free blocks
+#define HEAP_GROW_MIN_ORDER 6                     // Grow the heap 256 KiB at a time
+
+static free_block_t *heap_bins[HEAP_NUM_BINS];
+static uint32_t heap_bin_map = 0;
+static mem_stats_t heap_stats;
 uint32_t total_mem = 0;
 
-void *memset_pattern(void *ptr, const void *pattern, size_t pattern_size, size_t num) {
-    unsigned char *p = (unsigned char *)ptr;
-    const unsigned char *pat = (const unsigned char *)pattern;
-    size_t pat_idx = 0;
+multiboot_mmap_entry_t *acpi_reclaim_entries = NULL;
+uint32_t acpi_reclaim_count = 0;
+
+// ---------------------------------------------------------------------------
+// Size-class bins
+//
+// Free blocks are kept in segregated lists. Bins 0-15 hold blocks of exactly
+// 16, 32, ... 256 bytes, bins 16-20 hold power-of-two ranges up to 8 KiB and
+// the last bin holds every larger block. heap_bin_map has bit N set while
+// bin N is not empty, so finding a fitting bin is a single bit scan.
+//
+// Every header carries the size of the block physically before it (a
+// boundary tag), so a freed block finds both neighbours in O(1). The bins are
+// doubly linked through the payload of the free blocks, so unlinking a
+// neighbour during coalescing is O(1) as well.
+// ---------------------------------------------------------------------------
+static uint32_t heap_bin_index(uint32_t size) {
+    if (size <= HEAP_EXACT_MAX) {
+        return (size >> 4) - 1;
+    }
+    if (size >= HEAP_LARGE_MIN) {
+        return HEAP_LARGE_BIN;
+    }
+    return HEAP_EXACT_BINS + HIBIT(size) - 8;
+}
+
+// Smallest bin whose blocks are all guaranteed to hold 'size' bytes
+static uint32_t heap_fit_bin(uint32_t size) {
+    if (size <= HEAP_EXACT_MAX) {
+        return (size >> 4) - 1;
+    }
+    uint32_t bin = heap_bin_index(size);
+    if (bin != HEAP_LARGE_BIN && (size & (size - 1)) != 0) {
+        ++bin;
+    }
+    return bin;
+}
 
-    for (size_t i = 0; i < num; ++i) {
-        p[i] = pat[pat_idx];
-        pat_idx = (pat_idx + 1) % pattern_size;
+static void heap_bin_insert(block_header_t *block) {
+    uint32_t bin = heap_bin_index(block->size);
+    free_block_t *free_block = (free_block_t *)block;
+    block->is_free = 1;
+    free_block->prev = NULL;
+    free_block->next = heap_bins[bin];
+    if (heap_bins[bin] != NULL) {
+        heap_bins[bin]->prev = free_block;
     }
+    heap_bins[bin] = free_block;
+    heap_bin_map |= (1 << bin);
 
-    return ptr;
+    heap_stats.free_bytes += block->size;
+    heap_stats.free_blocks++;
+    heap_stats.bin_blocks[bin]++;
 }
 
-// Simple memset function (can be expanded if needed)
-void *memset(void *ptr, int value, size_t num) {
-    unsigned char *p = ptr;
-    while (num--) {
-        *p++ = (unsigned char)value;
+static void heap_bin_remove(block_header_t *block) {
+    uint32_t bin = heap_bin_index(block->size);
+    free_block_t *free_block = (free_block_t *)block;
+    if (free_block->prev != NULL) {
+        free_block->prev->next = free_block->next;
+    } else {
+        heap_bins[bin] = free_block->next;
     }
-    return ptr;
+    if (free_block->next != NULL) {
+        free_block->next->prev = free_block->prev;
+    }
+    if (heap_bins[bin] == NULL) {
+        heap_bin_map &= ~(1 << bin);
+    }
+    block->is_free = 0;
+
+    heap_stats.free_bytes -= block->size;
+    heap_stats.free_blocks--;
+    heap_stats.bin_blocks[bin]--;
+}
+
+// Header of the block physically following 'block' (a fence at region ends)
+static inline block_header_t *heap_next_block(block_header_t *block) {
+    return (block_header_t *)((uint8_t *)block + sizeof(block_header_t) + block->size);
 }
 
-// Simple memcpy function (can be expanded if needed)
-void *memcpy(void *dest, const void *src, size_t n) {
-    unsigned char *d = dest;
-    const unsigned char *s = src;
-    while (n--) {
-        *d++ = *s++;
+// Header of the block physically before 'block', NULL at the start of a region
+static inline block_header_t *heap_prev_block(block_header_t *block) {
+    if (block->prev_size == 0) {
+        return NULL;
     }
-    return dest;
+    return (block_header_t *)((uint8_t *)block - sizeof(block_header_t) - block->prev_size);
+}
+
+// Resize a block and keep the boundary tag of its successor in sync
+static inline void heap_set_size(block_header_t *block, uint32_t size) {
+    block->size = size;
+    heap_next_block(block)->prev_size = size;
 }
 
-int8_t memcmp(const char *str1, const char *str2, size_t n) {
-    while (n-- > 0) {
-        if (*str1 != *str2) {
-            return (unsigned char)(*str1) - (unsigned char)(*str2);
+// Merge a block that is not in any bin with its free neighbours
+static block_header_t *heap_coalesce(block_header_t *block) {
+    block_header_t *after = heap_next_block(block);
+    if (after->is_free) {
+        heap_bin_remove(after);
+        heap_set_size(block, block->size + sizeof(block_header_t) + after->size);
+    }
+
+    block_header_t *before = heap_prev_block(block);
+    if (before != NULL && before->is_free) {
+        heap_bin_remove(before);
+        heap_set_size(before, before->size + sizeof(block_header_t) + block->size);
+        block = before;
+    }
+    return block;
+}
+
+// Split the tail of 'block' off into a new free block if it is big enough
+static void heap_split(block_header_t *block, uint32_t size) {
+    if (block->size < size + sizeof(block_header_t) + HEAP_MIN_BLOCK) {
+        return;
+    }
+    block_header_t *tail = (block_header_t *)((uint8_t *)block + sizeof(block_header_t) + size);
+    tail->prev_size = size;
+    tail->tag = MEM_TAG_NONE;
+    heap_set_size(tail, block->size - size - sizeof(block_header_t));
+    block->size = size;
+
+    heap_bin_insert(heap_coalesce(tail));
+}
+
+// Take a free block of at least 'size' bytes out of the bins
+static block_header_t *heap_take(uint32_t size) {
+    uint32_t bin = heap_fit_bin(size);
+    uint32_t mask = heap_bin_map & (0xFFFFFFFF << bin);
+
+    // Everything below the large bin is guaranteed to fit, pop the head
+    if (mask & ~(1 << HEAP_LARGE_BIN)) {
+        block_header_t *block = &heap_bins[LOBIT(mask)]->header;
+        heap_bin_remove(block);
+        return block;
+    }
+
+    // Large objects: first fit over the (short) list of big blocks
+    for (free_block_t *block = heap_bins[HEAP_LARGE_BIN]; block != NULL; block = block->next) {
+        if (block->header.size >= size) {
+            heap_bin_remove(&block->header);
+            return &block->header;
         }
-        str1++;
-        str2++;
     }
-    return 0;  // Return 0 if strings are equal up to n characters
+    return NULL;
+}
+
+// Turn [base, base + length) into one free block followed by an end fence
+static void heap_add_region(uintptr_t base, uintptr_t length) {
+    uintptr_t start = (base + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1);
+    uintptr_t end = (base + length) & ~(uintptr_t)(HEAP_ALIGN - 1);
+    if (end <= start || end - start < 2 * sizeof(block_header_t) + HEAP_MIN_BLOCK) {
+        return;
+    }
+
+    if (heap_start == 0) {
+        heap_start = start;
+        heap_end = end;
+    }
+
+    block_header_t *block = (block_header_t *)start;
+    block->size = end - start - 2 * sizeof(block_header_t);
+    block->prev_size = 0;
+    block->tag = MEM_TAG_NONE;
+
+    // Zero sized, never free; stops coalescing from running off the region
+    block_header_t *fence = heap_next_block(block);
+    fence->size = 0;
+    fence->prev_size = block->size;
+    fence->is_free = 0;
+    fence->tag = MEM_TAG_NONE;
+
+    heap_bin_insert(block);
+}
+
+// Book keeping for a block that was just handed out / is about to come back
+static inline void heap_account_alloc(block_header_t *block, mem_tag_t tag, uint32_t size) {
+    block->tag = tag;
+    heap_stats.used_bytes += block->size;
+    heap_stats.used_blocks++;
+    heap_stats.alloc_count++;
+    heap_stats.alloc_histogram[heap_bin_index(size)]++;
+    heap_stats.tag_bytes[tag] += block->size;
+    heap_stats.tag_blocks[tag]++;
+}
+
+static inline void heap_account_free(block_header_t *block) {
+    heap_stats.used_bytes -= block->size;
+    heap_stats.used_blocks--;
+    heap_stats.free_count++;
+    heap_stats.tag_bytes[block->tag] -= block->size;
+    heap_stats.tag_blocks[block->tag]--;
+}
+
+// Pull another chunk for the heap out of the page frame allocator
+static uint8_t heap_grow(uint32_t size) {
+    uint32_t order = frame_order_for(size + 2 * sizeof(block_header_t));
+    if (order < HEAP_GROW_MIN_ORDER) {
+        order = HEAP_GROW_MIN_ORDER;
+    }
+
+    uint32_t phys = frame_alloc(order);
+    if (phys == FRAME_NONE) {
+        return 0;
+    }
+    heap_add_region(phys, FRAME_SIZE << order);
+    heap_stats.heap_bytes += FRAME_SIZE << order;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Allocation trace
+//
+// While on, every public allocator call is recorded as a compact event in a
+// ring that memory_trace_dump writes out for tools/replay. The ring has frames
+// of its own so tracing leaves the heap layout alone. Calls made from inside
+// another allocator call, like memrealloc moving a block, are not recorded.
+// ---------------------------------------------------------------------------
+static mem_trace_event_t *mem_trace_ring = NULL;
+static uint32_t mem_trace_capacity = 0;
+static uint32_t mem_trace_count = 0;              // Recorded since the start, the ring keeps the last ones
+static uint8_t mem_trace_on = 0;
+static uint32_t mem_trace_nest = 0;               // Depth of allocator calls in progress
+
+static void mem_trace(mem_trace_op_t op, uint32_t size, void *ptr, uint32_t arg, mem_tag_t tag) {
+    if (!mem_trace_on || mem_trace_nest != 0) {
+        return;
+    }
+    mem_trace_event_t *event = &mem_trace_ring[mem_trace_count++ % mem_trace_capacity];
+    event->timestamp = (uint32_t)rdtsc();
+    event->size = size;
+    event->ptr = (uint32_t)(uintptr_t)ptr;
+    event->arg = arg;
+    event->op = op;
+    event->tag = tag;
+    event->reserved = 0;
 }
 
-void *memmove(void *dst, const void *src, size_t n) {
-    // OK since we know that memcpy copies forwards
-    if (dst < src) {
-        return memcpy(dst, src, n);
+uint8_t memory_trace_start() {
+    if (mem_trace_ring == NULL) {
+        uint32_t phys = frame_alloc(MEM_TRACE_ORDER);
+        if (phys == FRAME_NONE) {
+            return 0;
+        }
+        mem_trace_ring = (mem_trace_event_t *)(uintptr_t)phys;
+        mem_trace_capacity = (FRAME_SIZE << MEM_TRACE_ORDER) / sizeof(mem_trace_event_t);
     }
+    mem_trace_count = 0;
+    mem_trace_on = 1;
+    return 1;
+}
 
-    uint8_t *d = dst;
-    const uint8_t *s = src;
+void memory_trace_stop() {
+    mem_trace_on = 0;
+}
 
-    for (size_t i = n; i > 0; i--) {
-        d[i - 1] = s[i - 1];
+static void mem_trace_put(const char *text) {
+    while (*text) {
+        outb(MEM_TRACE_PORT, *text++);
     }
+}
 
-    return dst;
+static void mem_trace_put_hex(uint32_t value) {
+    char digits[8];
+    uint32_t length = 0;
+    do {
+        digits[length++] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+    while (length-- > 0) {
+        outb(MEM_TRACE_PORT, digits[length]);
+    }
+    outb(MEM_TRACE_PORT, ' ');
 }
 
+// One line per event, oldest first: "@ op size ptr arg tag timestamp", in hex.
+// The console only has room for the tail, the debug port gets all of it.
+void memory_trace_dump() {
+    uint8_t was_on = mem_trace_on;
+    mem_trace_on = 0;
+
+    uint32_t kept = MIN(mem_trace_count, mem_trace_capacity);
+    terminal_printf("memtrace: %u events, %u dropped\n", kept, mem_trace_count - kept);
+    mem_trace_put("memtrace begin\n");
+    for (uint32_t i = mem_trace_count - kept; i < mem_trace_count; i++) {
+        mem_trace_event_t *event = &mem_trace_ring[i % mem_trace_capacity];
+        char op[5] = { '@', ' ', (char)event->op, ' ', 0 };
+        if (mem_trace_count - i <= 8) {
+            terminal_printf("%s%x %x %x %x %x\n", op, event->size, event->ptr,
+                event->arg, event->tag, event->timestamp);
+        }
+        mem_trace_put(op);
+        mem_trace_put_hex(event->size);
+        mem_trace_put_hex(event->ptr);
+        mem_trace_put_hex(event->arg);
+        mem_trace_put_hex(event->tag);
+        mem_trace_put_hex(event->timestamp);
+        outb(MEM_TRACE_PORT, '\n');
+    }
+    mem_trace_put("memtrace end\n");
+
+    mem_trace_on = was_on;
+}
 
 void memory_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_t *mmap_tag) {
+    // Every available region goes to the page frame allocator, the heap
+    // takes frames from it as it grows
+    memory_select_ops();
+    frame_initialize(entry, entry_count, mmap_tag);
+    dma_initialize(); // Before anything else can fragment low memory
+    heap_grow(0);
+#ifdef MEMORY_TRACE_BOOT
+    memory_trace_start(); // Capture the boot workload from the first allocation on
+#endif
+    isr_pool_initialize(); // Ready before any handler is registered
+
+    // The ACPI reclaimable regions are kept side by side in the boot arena
+    uint32_t reclaim_count = 0;
     for (uint32_t i = 0; i < entry_count; i++) {
         multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)( entry+(i*(mmap_tag->entry_size)) );
-        // terminal_printf("Entry %d: Base=0x%x, Length=0x%x, Type=%d\n", i, 
-        // entry_x->addr_hi, entry_x->len_hi, entry_x->type);
-
-        uint32_t addr_lo = entry_x->addr_lo;
-        uint32_t addr_hi = entry_x->addr_hi;
-        uint32_t len_lo = entry_x->len_lo;
-        uint32_t len_hi = entry_x->len_hi;
-        uint32_t type = entry_x->type;
-
-        // If the region is available (Type 1), initialize it
-        if (type == MULTIBOOT_MEMORY_AVAILABLE) {
-            uint32_t base_addr = addr_hi;
-            uint32_t length = len_hi;
-
-            // Check if the region overlaps with the restricted memory (_cstart to _end)
-            if ((base_addr+sizeof(block_header_t) < (uint32_t)&_cstart) && (base_addr + length > (uint32_t)&_cstart) ||
-            (base_addr+sizeof(block_header_t) < (uint32_t)&_end) && (base_addr + length > (uint32_t)&_end)) {
-                if ((base_addr+sizeof(block_header_t) < (uint32_t)&_cstart) && (base_addr + length > (uint32_t)&_cstart)) {
-                    length = (uint32_t)&_cstart - base_addr;
-                    if (heap_start == 0) {
-                        heap_start = base_addr;
-                        heap_end = base_addr + length;
-                    }
-
-                    // Initialize the free list for available memory regions
-                    block_header_t *current_block = (block_header_t *)base_addr;
-                    current_block->size = length - sizeof(block_header_t);  // Subtract header size
-                    current_block->next = NULL;
-                    current_block->is_free = 1;
-
-                    // Add the current block to the free list
-                    if (free_list == (void *)0xFFFFFFFF) {
-                        free_list = current_block;
-                    } else {
-                        block_header_t *last_block = free_list;
-                        while (last_block->next != NULL) {
-                            last_block = last_block->next;
-                        }
-                        last_block->next = current_block;
-                    }
-                }
-                length += (uint32_t)&_end - (uint32_t)&_cstart;
-                if (len_hi > length) {
-                    length = len_hi - length;
-                    base_addr = (uint32_t)&_end;
-                    if (heap_start == 0) {
-                        heap_start = base_addr;
-                        heap_end = base_addr + length;
-                    }
-
-                    // Initialize the free list for available memory regions
-                    block_header_t *current_block = (block_header_t *)base_addr;
-                    current_block->size = length - sizeof(block_header_t);  // Subtract header size
-                    current_block->next = NULL;
-                    current_block->is_free = 1;
-
-                    // Add the current block to the free list
-                    if (free_list == (void *)0xFFFFFFFF) {
-                        free_list = current_block;
-                    } else {
-                        block_header_t *last_block = free_list;
-                        while (last_block->next != NULL) {
-                            last_block = last_block->next;
-                        }
-                        last_block->next = current_block;
-                    }
-                }
-            } else if ((base_addr < _end) && (base_addr + length > _cstart)) {
-                // dont do nun
-            } else {
-                if (heap_start == 0) {
-                    heap_start = (uint32_t)base_addr;
-                    heap_end = (uint32_t)(base_addr + length);
-                }
-
-                // Initialize the free list for available memory regions
-                block_header_t *current_block = (block_header_t *)base_addr;
-                current_block->size = (uint32_t)length - sizeof(block_header_t);  // Subtract header size
-                current_block->next = NULL;
-                current_block->is_free = 1;
-
-                // Add the current block to the free list
-                if (free_list == (void *)0xFFFFFFFF) {
-                    free_list = current_block;
-                } else {
-                    block_header_t *last_block = free_list;
-                    while (last_block->next != NULL) {
-                        last_block = last_block->next;
-                    }
-                    last_block->next = current_block;
-                }
-            }
+        if (entry_x->type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE && mmap_entry_base(entry_x) < FRAME_LIMIT) {
+            ++reclaim_count;
         }
     }
-    void *some_space = (void *)0xFFFFFFFF;
-    uint32_t mem_so_far = 0;
+    acpi_reclaim_entries = (multiboot_mmap_entry_t *)arena_alloc(&boot_arena, reclaim_count * sizeof(multiboot_mmap_entry_t), 8);
+    if (acpi_reclaim_entries == (void *)0xFFFFFFFF) {
+        reclaim_count = 0;
+    }
+
+    acpi_reclaim_count = 0;
     for (uint32_t i = 0; i < entry_count; i++) {
         multiboot_mmap_entry_t *entry_x = (multiboot_mmap_entry_t *)( entry+(i*(mmap_tag->entry_size)) );
         // terminal_printf("Entry %d: Base=0x%x, Length=0x%x, Type=%d\n", i, 
         // entry_x->addr_hi, entry_x->len_hi, entry_x->type);
 
-        uint32_t addr_lo = entry_x->addr_lo;
-        uint32_t addr_hi = entry_x->addr_hi;
-        uint32_t len_lo = entry_x->len_lo;
-        uint32_t len_hi = entry_x->len_hi;
+        uint64_t base_addr = mmap_entry_base(entry_x);
         uint32_t type = entry_x->type;
 
         // If the region is acpi reclaimable (Type 3), initialize it
-        if (type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE) {
-            memrealloc(some_space, mem_so_far+sizeof(multiboot_mmap_entry_t)+4);
-            memcpy((void *)((uint32_t)some_space+mem_so_far), entry_x, sizeof(multiboot_mmap_entry_t));
-            acpi_header_t *acpi_addr = (acpi_header_t *)addr_hi; 
+        if (type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE && base_addr < FRAME_LIMIT) {
+            if (acpi_reclaim_count < reclaim_count) {
+                memcpy(&acpi_reclaim_entries[acpi_reclaim_count++], entry_x, sizeof(multiboot_mmap_entry_t));
+            }
+            acpi_header_t *acpi_addr = (acpi_header_t *)(uint32_t)base_addr;
             char ntstr[5];
             memcpy(ntstr, acpi_addr->signature, 4);
             terminal_printf("ACPI table found!\nSignature: %s, Length 0x%x, Revision %d\n",
@@ -198,87 +381,221 @@ void memory_initialize(uint32_t entry, uint32_t entry_count, multiboot_tag_mmap_
     }
 }
 
-/* Traverse a Unary Tree, or Node Tree, or something like that idk
-
 
-block_header_t *last_block = free_list;
-while (last_block->next != NULL) {
-    last_block = last_block->next;
+// Allocate a block of memory
+void *memalloc(size_t size) {
+    return memalloc_tagged(size, MEM_TAG_NONE);
 }
 
-block_header_t *last_block = free_list;
-    while (last_block->next != NULL) {
-        terminal_printf("Block %x of size %x points at %x and is %d\n", 
-        last_block, last_block->size, last_block->next, last_block->is_free);
+// ---------------------------------------------------------------------------
+// Page-backed allocations
+//
+// Requests of HEAP_PAGE_MIN bytes and up skip the bins and get whole pages.
+// With paging on, the pages are mapped one by one into the large allocation
+// window, so they do not have to be physically contiguous. Without paging
+// they are one contiguous frame run used through the identity mapping.
+// Runs are page colored when memory allows, so the big render buffers these
+// usually are do not all start on the same L2 sets. Zeroed requests come
+// from the demand-zero window instead, where only the pages that get
+// written ever take a frame. Either way the header sits at the start of the first page, prev_size holds
+// the page count and memfree hands the pages straight back.
+// ---------------------------------------------------------------------------
+static uint32_t heap_window_map[HEAP_WINDOW_PAGES / 32];  // Bit set while the window page is in use
+static uint32_t heap_window_hint = 0;                     // Where the next search starts
+
+// First run of 'count' free window pages, searching from the hint and wrapping once
+static uint32_t heap_window_find(uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t scanned = 0, page = heap_window_hint; scanned < HEAP_WINDOW_PAGES + count; scanned++, page++) {
+        if (page == HEAP_WINDOW_PAGES) {
+            page = 0;
+            run = 0;
+        }
+        if (heap_window_map[page >> 5] & (1 << (page & 31))) {
+            run = 0;
+        } else if (++run == count) {
+            return page + 1 - count;
+        }
+    }
+    return HEAP_WINDOW_PAGES;
+}
 
-        last_block = last_block->next;
+static void heap_window_mark(uint32_t first, uint32_t count, uint8_t used) {
+    for (uint32_t page = first; page < first + count; page++) {
+        if (used) {
+            heap_window_map[page >> 5] |= 1 << (page & 31);
+        } else {
+            heap_window_map[page >> 5] &= ~(1 << (page & 31));
+        }
     }
-    terminal_printf("Block %x of size %x points at %x and is %d\n", 
-    last_block, last_block->size, last_block->next, last_block->is_free);
+}
 
-*/
+// One flush for the whole run, the frames go back once it is done
+static void heap_unmap_pages(uint32_t virt, uint32_t count) {
+    tlb_gather_t gather;
+    tlb_gather_init(&gather);
+    for (uint32_t i = 0; i < count; i++, virt += FRAME_SIZE) {
+        tlb_gather_unmap(&gather, virt, true);
+    }
+    tlb_gather_flush(&gather);
+}
 
+static inline uint8_t heap_block_paged(block_header_t *block) {
+    return block->is_free == HEAP_BLOCK_FRAMES || block->is_free == HEAP_BLOCK_MAPPED ||
+        block->is_free == HEAP_BLOCK_DEMAND;
+}
 
-// Allocate a block of memory
-void *memalloc(size_t size) {
-    block_header_t *current = free_list;
-
-    // Align to 8 bytes
-    size = (size + 7) & ~7;
-
-    while (current->next != 0x0) {
-        // Check if the block is free and large enough
-        if (current->is_free && current->size >= size) {
-            // If the block is much larger than the requested size, split it
-            if (current->size > size + sizeof(block_header_t)) {
-                block_header_t *new_block = (block_header_t *)((uint8_t *)current + sizeof(block_header_t) + size);
-                new_block->size = current->size - size - sizeof(block_header_t);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-
-                current->size = size;
-                current->next = new_block;
+static block_header_t *heap_alloc_pages(uint32_t size, uint8_t zeroed) {
+    uint32_t count = (size + sizeof(block_header_t) + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    block_header_t *block;
+
+    // Zeroed blocks are often big sparse tables, let them fill in as they are written
+    block = paging_active && zeroed ? demand_reserve(count << FRAME_SHIFT) : (void *)0xFFFFFFFF;
+    if (block != (void *)0xFFFFFFFF) {
+        block->is_free = HEAP_BLOCK_DEMAND;
+    } else if (paging_active) {
+        uint32_t first = heap_window_find(count);
+        if (first == HEAP_WINDOW_PAGES) {
+            return NULL;
+        }
+        uint32_t virt = HEAP_WINDOW_BASE + (first << FRAME_SHIFT);
+        uint32_t run = frame_alloc_colored(count, FRAME_COLOR_NEXT);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t phys = run != FRAME_NONE ? run + (i << FRAME_SHIFT) :
+                zeroed ? frame_alloc_zeroed() : frame_alloc_page();
+            if (phys != FRAME_NONE) {
+                set_page_mapping(virt + (i << FRAME_SHIFT), phys, PAGE_SYSGLOBAL);
             }
+            // No frame, or no frame for its page table
+            if (phys == FRAME_NONE || virt_to_phys(virt + (i << FRAME_SHIFT)) == PAGING_NO_MAPPING) {
+                if (phys != FRAME_NONE) {
+                    frame_free_page(phys);
+                }
+                heap_unmap_pages(virt, i);
+                if (run != FRAME_NONE) {
+                    frame_free_pages(run + ((i + 1) << FRAME_SHIFT), count - i - 1);
+                }
+                return NULL;
+            }
+        }
+        if (run != FRAME_NONE && zeroed) {
+            memset((void *)virt, 0, count << FRAME_SHIFT);
+        }
+        heap_window_mark(first, count, 1);
+        heap_window_hint = first + count;
+        block = (block_header_t *)virt;
+        block->is_free = HEAP_BLOCK_MAPPED;
+    } else {
+        uint32_t phys = frame_alloc_colored(count, FRAME_COLOR_NEXT);
+        if (phys == FRAME_NONE) {
+            return NULL;
+        }
+        block = (block_header_t *)phys;
+        if (zeroed) {
+            memset(block, 0, count << FRAME_SHIFT);
+        }
+        block->is_free = HEAP_BLOCK_FRAMES;
+    }
+
+    block->size = (count << FRAME_SHIFT) - sizeof(block_header_t);
+    block->prev_size = count;
+    heap_stats.page_bytes += count << FRAME_SHIFT;
+    heap_stats.page_blocks++;
+    return block;
+}
 
-            // Mark the block as allocated
-            current->is_free = 0;
-            return (void *)((uint32_t)((uint8_t *)current + sizeof(block_header_t))+1);
+static void heap_free_pages(block_header_t *block) {
+    uint32_t count = block->prev_size;
+    heap_stats.page_bytes -= count << FRAME_SHIFT;
+    heap_stats.page_blocks--;
+
+    if (block->is_free == HEAP_BLOCK_DEMAND) {
+        demand_release(block, count << FRAME_SHIFT);
+    } else if (block->is_free == HEAP_BLOCK_MAPPED) {
+        uint32_t virt = (uint32_t)block;
+        heap_unmap_pages(virt, count);
+        heap_window_mark((virt - HEAP_WINDOW_BASE) >> FRAME_SHIFT, count, 0);
+    } else {
+        frame_free_pages((uint32_t)block, count);
+    }
+}
+
+// Allocation shared by memalloc_tagged and memcalloc
+static void *heap_alloc(size_t size, mem_tag_t tag, uint8_t zeroed) {
+    // Payloads are 16 byte aligned, so are the sizes
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (size == 0) {
+        size = HEAP_MIN_BLOCK;
+    }
+    tag = tag < MEM_TAG_COUNT ? tag : MEM_TAG_NONE;
+
+    if (size >= HEAP_PAGE_MIN) {
+        block_header_t *block = heap_alloc_pages(size, zeroed);
+        if (block == NULL) {
+            heap_stats.failed_count++;
+            return (void *)0xFFFFFFFF;
         }
+        heap_account_alloc(block, tag, size);
+        return (void *)((uint8_t *)block + sizeof(block_header_t));
+    }
 
-        current = current->next;
+    block_header_t *block = heap_take(size);
+    if (block == NULL && heap_grow(size)) {
+        block = heap_take(size);
+    }
+    if (block == NULL) {
+        // No suitable block found, 
+        // NULL could very well point to block 0 so
+        // I used 0xFFFFFFFF to be safe
+        // TODO: REPLACE WITH OUT_OF_RAM ERR
+        // WHEN I ADD INTERUPTS
+        heap_stats.failed_count++;
+        return (void *)0xFFFFFFFF;
     }
 
-    // No suitable block found, 
-    // NULL could very well point to block 0 so
-    // I used 0xFFFFFFFF to be safe
-    // TODO: REPLACE WITH OUT_OF_RAM ERR
-    // WHEN I ADD INTERUPTS
-    return (void *)0xFFFFFFFF; 
+    // If the block is much larger than the requested size, split it
+    heap_split(block, size);
+
+    // Mark the block as allocated
+    block->is_free = 0;
+    heap_account_alloc(block, tag, size);
+
+    void *payload = (void *)((uint8_t *)block + sizeof(block_header_t));
+    if (zeroed) {
+        memset(payload, 0, size);
+    }
+    return payload;
+}
+
+// Allocate a block of memory and charge it to a subsystem in the heap stats
+void *memalloc_tagged(size_t size, mem_tag_t tag) {
+    void *ptr = heap_alloc(size, tag, 0);
+    mem_trace(MEM_TRACE_ALLOC, size, ptr, 0, tag);
+    return ptr;
 }
 
 
 
 // Free a block of memory
 void memfree(void *ptr) {
-    if (!ptr) return;
+    if (!ptr || ptr == (void *)0xFFFFFFFF) return;
+    mem_trace(MEM_TRACE_FREE, 0, ptr, 0, MEM_TAG_NONE);
 
     block_header_t *block = (block_header_t *)((uint8_t *)ptr - sizeof(block_header_t));
-    block->is_free = 1;
-
-    // Merge adjacent free blocks
-    block_header_t *current = free_list;
-
-    while (current) {
-        if (current->is_free && current->next && current->next->is_free) {
-            current->size += sizeof(block_header_t) + current->next->size;
-            current->next = current->next->next;
-        }
-        current = current->next;
+    if (heap_block_paged(block)) {
+        heap_account_free(block);
+        heap_free_pages(block);
+        return;
     }
+    if (block->is_free) return;
+    heap_account_free(block);
+
+    // Merge with the physical neighbours through the boundary tags
+    heap_bin_insert(heap_coalesce(block));
 }
 
-void *memrealloc(void *ptr, size_t new_size) {
-    new_size = (new_size + 7) & ~7;
+static void *heap_realloc(void *ptr, size_t new_size) {
+    new_size = (new_size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
     if (new_size == 0) {
         if (ptr != (void *)0xFFFFFFFF) {
             memfree(ptr);
@@ -290,14 +607,35 @@ void *memrealloc(void *ptr, size_t new_size) {
     }
 
     block_header_t *block = (block_header_t *)((uint8_t *)ptr - sizeof(block_header_t));
+    uint32_t old_size = block->size;
+
+    // Page-backed blocks keep their pages while the data still fits
+    uint8_t paged = heap_block_paged(block);
+    if (paged && block->size >= new_size) {
+        return ptr;
+    }
 
     // Check if the current block is large enough to satisfy the request
-    if (block->size >= new_size) {
-        return ptr; // No need to move; current block is sufficient
+    if (!paged && block->size >= new_size) {
+        heap_split(block, new_size); // Shrink in place, the tail goes back to the bins
+        heap_stats.used_bytes -= old_size - block->size;
+        heap_stats.tag_bytes[block->tag] -= old_size - block->size;
+        return ptr;
+    }
+
+    // Grow in place by absorbing the physically next block if it is free
+    block_header_t *after = heap_next_block(block);
+    if (!paged && after->is_free == 1 && block->size + sizeof(block_header_t) + after->size >= new_size) {
+        heap_bin_remove(after);
+        heap_set_size(block, block->size + sizeof(block_header_t) + after->size);
+        heap_split(block, new_size);
+        heap_stats.used_bytes += block->size - old_size;
+        heap_stats.tag_bytes[block->tag] += block->size - old_size;
+        return ptr;
     }
 
     // Allocate a new block
-    void *new_ptr = memalloc(new_size);
+    void *new_ptr = memalloc_tagged(new_size, block->tag);
     if (new_ptr == (void *)0xFFFFFFFF) {
         return (void *)0xFFFFFFFF; // Allocation failed
     }
@@ -311,65 +649,160 @@ void *memrealloc(void *ptr, size_t new_size) {
     return new_ptr;
 }
 
+void *memrealloc(void *ptr, size_t new_size) {
+    mem_trace_nest++;
+    void *new_ptr = heap_realloc(ptr, new_size);
+    mem_trace_nest--;
+    mem_trace(MEM_TRACE_REALLOC, new_size, new_ptr, (uint32_t)(uintptr_t)ptr, MEM_TAG_NONE);
+    return new_ptr;
+}
+
 // Allocate and zero-initialize memory (calloc)
 void *memcalloc(size_t num, size_t size) {
     size_t total_size = num * size;
 
-    // Allocate the memory
-    void *ptr = memalloc(total_size);
-    if (ptr == (void *)0xFFFFFFFF) {
-        return (void *)0xFFFFFFFF; // Allocation failed
-    }
-
-    // Zero-initialize the memory
-    memset(ptr, 0, total_size);
+    // Allocate the memory, zero-initialized (large ones from the zeroed page pool)
+    void *ptr = heap_alloc(total_size, MEM_TAG_NONE, 1);
+    mem_trace(MEM_TRACE_CALLOC, total_size, ptr, 0, MEM_TAG_NONE);
     return ptr;
 }
 
 // Allocate a block of memory with a specified alignment
-void *mem_alloc_aligned(size_t size, size_t alignment) {
+static void *heap_alloc_aligned(size_t size, size_t alignment) {
     // Ensure alignment is a power of two
     if ((alignment & (alignment - 1)) != 0 || alignment == 0) {
         return (void *)0xFFFFFFFF; // Invalid alignment
     }
+    if (alignment <= HEAP_ALIGN) {
+        return memalloc(size);
+    }
 
-    block_header_t *current = free_list;
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (size == 0) {
+        size = HEAP_MIN_BLOCK;
+    }
 
-    // Round up size to the nearest multiple of alignment
-    size_t aligned_size = (size + alignment - 1) & ~(alignment - 1);
+    // Worst case we have to carve a minimal free block off the front
+    uint32_t padded_size = size + alignment + sizeof(block_header_t) + HEAP_MIN_BLOCK;
+    block_header_t *block = heap_take(padded_size);
+    if (block == NULL && heap_grow(padded_size)) {
+        block = heap_take(padded_size);
+    }
+    if (block == NULL) {
+        heap_stats.failed_count++;
+        return (void *)0xFFFFFFFF;
+    }
 
-    while (current != NULL) {
-        // Check if block is free and can accommodate worst-case offset + aligned_size
-        if (current->is_free && current->size >= aligned_size + (alignment - 1)) {
-            uint8_t *start_ptr = (uint8_t *)current + sizeof(block_header_t);
-            uintptr_t start_addr = (uintptr_t)start_ptr;
-            uintptr_t offset = (alignment - (start_addr % alignment)) % alignment;
-            uint8_t *aligned_ptr = start_ptr + offset;
+    uintptr_t payload = (uintptr_t)block + sizeof(block_header_t);
+    if (payload & (alignment - 1)) {
+        uintptr_t aligned = (payload + sizeof(block_header_t) + HEAP_MIN_BLOCK + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        block_header_t *aligned_block = (block_header_t *)(aligned - sizeof(block_header_t));
+
+        // The padding in front becomes a free block of its own
+        aligned_block->prev_size = (uintptr_t)aligned_block - payload;
+        aligned_block->is_free = 0;
+        aligned_block->tag = MEM_TAG_NONE;
+        heap_set_size(aligned_block, block->size - (aligned - payload));
+        block->size = aligned_block->prev_size;
+        heap_bin_insert(block);
+        block = aligned_block;
+    }
 
-            size_t total_used = offset + aligned_size;
+    heap_split(block, size);
+    block->is_free = 0;
+    heap_account_alloc(block, MEM_TAG_NONE, size);
+    return (void *)((uint8_t *)block + sizeof(block_header_t));
+}
 
-            // Check if remaining space can be split into a new block
-            if (current->size >= total_used + sizeof(block_header_t) + 1) {
-                block_header_t *new_block = (block_header_t *)(aligned_ptr + aligned_size);
-                new_block->size = current->size - total_used - sizeof(block_header_t);
-                new_block->is_free = 1;
-                new_block->next = current->next;
+void *mem_alloc_aligned(size_t size, size_t alignment) {
+    mem_trace_nest++;
+    void *ptr = heap_alloc_aligned(size, alignment);
+    mem_trace_nest--;
+    mem_trace(MEM_TRACE_ALIGNED, size, ptr, alignment, MEM_TAG_NONE);
+    return ptr;
+}
 
-                current->size = total_used;
-                current->next = new_block;
-            }
 
-            current->is_free = 0;
-            return aligned_ptr;
-        }
-        current = current->next;
+uint32_t get_total_memory() {
+    return total_mem;
+}
+
+// ---------------------------------------------------------------------------
+// Heap statistics
+//
+// The counters are updated inline by the allocator, so taking a snapshot is
+// a copy plus one walk of the highest non-empty bin for the largest block.
+// ---------------------------------------------------------------------------
+void memory_get_stats(mem_stats_t *stats) {
+    *stats = heap_stats;
+    stats->largest_free = 0;
+    if (heap_bin_map == 0) {
+        return;
     }
 
-    // No suitable block found
-    return (void *)0xFFFFFFFF;
+    uint32_t bin = HIBIT(heap_bin_map);
+    for (free_block_t *block = heap_bins[bin]; block != NULL; block = block->next) {
+        if (block->header.size > stats->largest_free) {
+            stats->largest_free = block->header.size;
+        }
+    }
 }
 
+static const char *const mem_tag_names[MEM_TAG_COUNT] = {
+    "none", "kernel"
+};
+
+void memory_print_stats() {
+    static uint64_t last_counter = 0;
+    static uint32_t last_allocs = 0, last_frees = 0;
+    mem_stats_t stats;
+    memory_get_stats(&stats);
+
+    terminal_printf("Heap: %u KiB, %u KiB used in %u blocks, %u KiB free in %u blocks\n",
+        stats.heap_bytes >> 10, stats.used_bytes >> 10, stats.used_blocks,
+        stats.free_bytes >> 10, stats.free_blocks);
+    terminal_printf("Largest free block: %u bytes, allocs %u, frees %u, failed %u\n",
+        stats.largest_free, stats.alloc_count, stats.free_count, stats.failed_count);
+    terminal_printf("Page-backed: %u KiB in %u blocks\n", stats.page_bytes >> 10, stats.page_blocks);
+    uint32_t zero_hits, zero_misses, zero_pooled;
+    frame_zero_stats(&zero_hits, &zero_misses, &zero_pooled);
+    terminal_printf("Frames: %u free of %u, %u zeroed pages pooled (%u hits, %u misses), %u colors\n",
+        frame_free_count(), frame_total_count(), zero_pooled, zero_hits, zero_misses, frame_color_count());
+    if (frame_high_total_count() != 0) {
+        terminal_printf("High frames: %u free of %u\n", frame_high_free_count(), frame_high_total_count());
+    }
+    dma_print_stats();
+    terminal_printf("Boot arena: %u bytes in %u chunks%s\n", boot_arena.bytes, boot_arena.chunk_count,
+        boot_arena.sealed ? " (sealed)" : "");
+
+    // Rates since the previous print
+    uint64_t counter = HPET_ReadCounter();
+    float elapsed = (float)(counter - last_counter) / HPET_FREQ;
+    if (last_counter != 0 && elapsed > 0) {
+        terminal_printf("Since last: %u allocs/s, %u frees/s over %u ms\n",
+            (uint32_t)((stats.alloc_count - last_allocs) / elapsed),
+            (uint32_t)((stats.free_count - last_frees) / elapsed), (uint32_t)(elapsed * 1000));
+    }
+    last_counter = counter;
+    last_allocs = stats.alloc_count;
+    last_frees = stats.free_count;
+
+    // Size class histogram: requests served / free blocks waiting per bin
+    for (uint32_t bin = 0; bin < HEAP_NUM_BINS; bin++) {
+        if (stats.alloc_histogram[bin] == 0 && stats.bin_blocks[bin] == 0) {
+            continue;
+        }
+        // Exact bins hold one size, the others everything below the next power of two
+        const char *relation = bin < HEAP_EXACT_BINS ? "<=" : (bin == HEAP_LARGE_BIN ? ">=" : "<");
+        uint32_t class_size = bin < HEAP_EXACT_BINS ? (bin + 1) * HEAP_ALIGN :
+            (bin == HEAP_LARGE_BIN ? (uint32_t)HEAP_LARGE_MIN : (uint32_t)HEAP_EXACT_MAX << (bin - HEAP_EXACT_BINS + 1));
+        terminal_printf("  %s%u: %u allocs, %u free\n", relation, class_size,
+            stats.alloc_histogram[bin], stats.bin_blocks[bin]);
+    }
 
-uint32_t get_total_memory() {
-    return total_mem;
-}
\ No newline at end of file
+    for (uint32_t tag = 0; tag < MEM_TAG_COUNT; tag++) {
+        if (stats.tag_blocks[tag] != 0) {
+            terminal_printf("  [%s] %u bytes in %u blocks\n", mem_tag_names[tag], stats.tag_bytes[tag], stats.tag_blocks[tag]);
+        }
+    }
+}
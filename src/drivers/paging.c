@@ -4,30 +4,131 @@
 #include "terminal.h"
 #include "paging.h"
 #include "memory.h"
+#include "frame.h"
 #include "util.h"
 #include "idt.h"
 #include "isr.h"
 #include "io.h"
+#include "tlb.h"
+#include "demand.h"
+#include "vmap.h"
 
 #define PAGE_SIZE 4096
-#define NUM_ENTRIES 1024
-
-uint32_t page_directory[NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
-uint32_t* page_tables[NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+#define NUM_ENTRIES PAGING_TABLE_ENTRIES
+
+// Filled in by the boot stub in grub_entry.asm, which turns paging on with it
+pte_t page_directory[PAGING_DIR_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+uint64_t page_dir_pointers[PAGING_PDPT_ENTRIES] __attribute__((aligned(32)));
+#endif
+uint8_t paging_active = 0;
+static uint8_t paging_pge = 0;  // Global pages enabled in CR4
+static uint8_t paging_nx = 0;   // PAGE_EXECUTE_DISABLE reaches the entries
+
+// Backs the fixmap slot, a static table so using it never needs a frame
+static pte_t paging_fixmap_table[NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+
+static struct {
+    uint32_t faults;
+    uint32_t not_present;
+    uint32_t protection;
+    uint32_t writes;            // The rest were reads
+    uint32_t user;              // The rest came from the kernel
+    uint32_t fetches;
+    uint32_t reserved;
+    uint32_t handled;           // Resolved and returned from, the others halted
+    uint32_t latency[PAGING_FAULT_BUCKETS];
+    uint32_t unmapped_pages;    // Pages unmap_page found mapped
+} paging_stats;
+
+// The pages that faulted most, kept approximately: a page that is not in the
+// table takes the place of the least faulted one and inherits its count, so
+// a page faulting often enough always makes it in
+static struct {
+    uint32_t page;
+    uint32_t count;
+} paging_top[PAGING_FAULT_TOP];
 
 // ---------------------------------------------------------------------------
-// flush_tlb_range: Flush TLB entries for the virtual address range [start, end)
+// Fault accounting
 // ---------------------------------------------------------------------------
-void flush_tlb_range(uint32_t start, uint32_t end) {
-    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
-        asm("invlpg (%0)" : : "r" (addr) : "memory");
+static void paging_count_fault(uint32_t fault_addr, uint32_t error) {
+    paging_stats.faults++;
+    if (error & PAGING_FAULT_PRESENT) {
+        paging_stats.protection++;
+    } else {
+        paging_stats.not_present++;
+    }
+    paging_stats.writes += (error & PAGING_FAULT_WRITE) != 0;
+    paging_stats.user += (error & PAGING_FAULT_USER) != 0;
+    paging_stats.reserved += (error & PAGING_FAULT_RESERVED) != 0;
+    paging_stats.fetches += (error & PAGING_FAULT_FETCH) != 0;
+
+    uint32_t page = fault_addr & 0xFFFFF000;
+    uint32_t least = 0;
+    for (uint32_t i = 0; i < PAGING_FAULT_TOP; i++) {
+        if (paging_top[i].count != 0 && paging_top[i].page == page) {
+            paging_top[i].count++;
+            return;
+        }
+        if (paging_top[i].count < paging_top[least].count) {
+            least = i;
+        }
+    }
+    paging_top[least].page = page;
+    paging_top[least].count++;
+}
+
+static void paging_count_latency(uint32_t cycles) {
+    uint32_t bucket = 0;
+    if (cycles >> PAGING_FAULT_MIN_SHIFT) {
+        bucket = MIN((uint32_t)HIBIT(cycles) + 1 - PAGING_FAULT_MIN_SHIFT, (uint32_t)PAGING_FAULT_BUCKETS - 1);
     }
+    paging_stats.latency[bucket]++;
+    paging_stats.handled++;
+}
+
+void paging_print_stats() {
+    terminal_printf("Page faults: %u, %u handled\n", paging_stats.faults, paging_stats.handled);
+    terminal_printf("  %u not present, %u protection; %u reads, %u writes; %u kernel, %u user\n",
+        paging_stats.not_present, paging_stats.protection, paging_stats.faults - paging_stats.writes,
+        paging_stats.writes, paging_stats.faults - paging_stats.user, paging_stats.user);
+    terminal_printf("  %u instruction fetches, %u reserved bits\n", paging_stats.fetches, paging_stats.reserved);
+
+    terminal_printf("  cycles:");
+    for (uint32_t i = 0; i < PAGING_FAULT_BUCKETS - 1; i++) {
+        terminal_printf(" <%u:%u", 1u << (PAGING_FAULT_MIN_SHIFT + i), paging_stats.latency[i]);
+    }
+    terminal_printf(" more:%u\n", paging_stats.latency[PAGING_FAULT_BUCKETS - 1]);
+
+    // Most faulted first, the table is small enough to pick them one by one
+    uint8_t shown[PAGING_FAULT_TOP] = { 0 };
+    for (uint32_t n = 0; n < PAGING_FAULT_TOP; n++) {
+        uint32_t best = PAGING_FAULT_TOP;
+        for (uint32_t i = 0; i < PAGING_FAULT_TOP; i++) {
+            if (!shown[i] && paging_top[i].count != 0 && (best == PAGING_FAULT_TOP || paging_top[i].count > paging_top[best].count)) {
+                best = i;
+            }
+        }
+        if (best == PAGING_FAULT_TOP) {
+            break;
+        }
+        shown[best] = 1;
+        terminal_printf("  0x%x: %u faults\n", paging_top[best].page, paging_top[best].count);
+    }
+    terminal_printf("  %u pages through unmap_page\n", paging_stats.unmapped_pages);
 }
 
 void page_fault_handler(Registers *regs) {
+    uint64_t start = rdtsc();
     uint32_t fault_addr;
     // Retrieve the faulting address from CR2
     asm("mov %%cr2, %0" : "=r" (fault_addr));
+    paging_count_fault(fault_addr, regs->error);
+    if (demand_fault(fault_addr, regs->error)) {
+        paging_count_latency((uint32_t)(rdtsc() - start));
+        return;
+    }
 
     // Print out basic page fault information
     terminal_printf("Page fault at address: 0x%x\n", fault_addr);
@@ -54,93 +155,320 @@ void page_fault_handler(Registers *regs) {
     } else {
         terminal_printf("Fault occurred in kernel mode.\n");
     }
+    if (regs->error & PAGING_FAULT_FETCH) {
+        terminal_printf("Instruction fetch from a no-execute page.\n");
+    }
+    if (regs->error & PAGING_FAULT_RESERVED) {
+        terminal_printf("Reserved bit set in a paging entry.\n");
+    }
 
-    // Here you might add handling logic to load a page from disk, allocate a new page, etc.
-    // For now, we'll simply halt the system.
+    // Nothing else resolves faults yet, returning would only fault again
     terminal_printf("Halting system due to page fault.\n");
+    paging_print_stats();
+    HALT();
 }
 
 // ---------------------------------------------------------------------------
-// paging_init: Set up a basic paging system with an identity mapping for the first part of memory.
+// paging_init: Trim the boot stub's map down to the memory that is there.
+//
+// The boot stub already runs the kernel in the higher half, with everything
+// below KERNEL_VIRT_BASE identity mapped by 4 MiB pages so the early code can
+// read the boot tables wherever they are. Here that identity map is cut back
+// to the frames and ACPI tables, so stray pointers into nothing fault again.
+//
+// Kernel mappings are the same in every address space, so with PGE they are
+// made global and keep their TLB entries across CR3 reloads.
 // ---------------------------------------------------------------------------
 void paging_init() {
     terminal_printf("Initializing paging...\n");
     ISR_RegisterHandler(14, (ISRHandler)page_fault_handler);
-
-    // Zero out the page directory
-    for (size_t i = 0; i < NUM_ENTRIES; i++) {
-        page_directory[i] = 0;
+    pat_initialize();
+    tlb_initialize();
+
+    // Before the first entry with NX in it, the bit is reserved until then
+    uint32_t eax, ebx, ecx, edx;
+#ifdef __PHYSICAL_MEMORY_EXTENSION__
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        if (edx & CPUID_80000001_EDX_NX) {
+            cpuGetMSR(PAGING_EFER_MSR, &eax, &edx);
+            cpuSetMSR(PAGING_EFER_MSR, eax | PAGING_EFER_NXE, edx);
+            paging_nx = 1;
+        }
     }
+#endif
 
-    // Create a page table for the first 4 MiB
-    uint32_t* first_page_table = (uint32_t*)mem_alloc_aligned(PAGE_SIZE, PAGE_SIZE);
-    if (first_page_table == NULL) {
-        terminal_printf("Error: Failed to allocate memory for the first page table.\n");
-        return;
+    // Every frame, and the ACPI tables that often sit right above the last one
+    uint64_t top = (uint64_t)frame_span() << FRAME_SHIFT;
+    for (uint32_t i = 0; i < acpi_reclaim_count; i++) {
+        top = MAX(top, mmap_entry_base(&acpi_reclaim_entries[i]) + mmap_entry_length(&acpi_reclaim_entries[i]));
     }
-    memset(first_page_table, 0, PAGE_SIZE);
-
-    // Map the first 4 MiB of physical memory to the first 4 MiB of virtual memory
-    for (size_t i = 0; i < NUM_ENTRIES; i++) {
-        first_page_table[i] = (i * PAGE_SIZE) | PAGE_SYSDEFAULT;
+    top = MIN((top + PAGING_LARGE_PAGE_SIZE - 1) & ~(uint64_t)(PAGING_LARGE_PAGE_SIZE - 1), FRAME_DIRECT_LIMIT);
+    // Not global: the range below the kernel is where per-process mappings
+    // will go, and global entries would outlive the CR3 switch to them
+    paging_map_range(0, 0, (uint32_t)top, PAGE_SYSDEFAULT);
+
+    // Text, rodata, data and bss all sit in the kernel's large pages
+    uint32_t kernel_size = (KERNEL_PHYS(&_end) + PAGING_LARGE_PAGE_SIZE - 1) & ~(PAGING_LARGE_PAGE_SIZE - 1);
+    paging_map_range(KERNEL_VIRT_BASE, 0, kernel_size, PAGE_SYSGLOBAL);
+
+    // Devices mapped since boot have replaced their entries, so only entries
+    // still exactly as the stub left them go
+    for (uint32_t i = top >> PAGING_DIR_SHIFT; i < (KERNEL_VIRT_BASE >> PAGING_DIR_SHIFT); i++) {
+        if (page_directory[i] == (((pte_t)i << PAGING_DIR_SHIFT) | PAGE_4MB | PAGE_SYSDEFAULT)) {
+            page_directory[i] = 0;
+        }
     }
+    load_cr3(PAGING_ROOT);
+
+    // The zero page behind demand-zero memory is read-only, and without WP
+    // kernel writes would go straight through to it
+    uint32_t cr0;
+    asm("mov %%cr0, %0" : "=r"(cr0));
+    asm("mov %0, %%cr0" : : "r"(cr0 | PAGING_CR0_WP) : "memory");
+
+    // Turning PGE on flushes everything, global entries included
+    uint32_t cr4;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_1_EDX_PGE) {
+        asm("mov %%cr4, %0" : "=r"(cr4));
+        asm("mov %0, %%cr4" : : "r"(cr4 | PAGING_CR4_PGE) : "memory");
+        paging_pge = 1;
+    }
+    paging_active = 1;
+    demand_initialize();
+    vmap_initialize();
+
+    terminal_printf("Paging enabled%s, %u MiB identity mapped, kernel at 0x%x.\n",
+        PAGING_PTE_NX ? (paging_nx ? " (PAE, NX)" : " (PAE)") : "", (uint32_t)(top >> 20), (uint32_t)&_cstart);
+    terminal_printf("Kernel text %u KiB, rodata %u KiB, data %u KiB, bss %u KiB, %s.\n",
+        ((uint32_t)&_ecode - (uint32_t)&_cstart) >> 10, ((uint32_t)&_erodata - (uint32_t)&_ecode) >> 10,
+        ((uint32_t)&_edata - (uint32_t)&_erodata) >> 10, ((uint32_t)&_end - (uint32_t)&_edata) >> 10,
+        paging_pge ? "global" : "not global, no PGE");
+}
 
-    // Set the first entry of the page directory to point to the first page table
-    page_directory[0] = ((uint32_t)first_page_table) | PAGE_DEFAULT;
+// The hardware bits for 'flags', in the entry of a 4 KiB page or of a large
+// one. PAGE_PAT and PAGE_EXECUTE_DISABLE only say what is wanted.
+static pte_t paging_entry_flags(PageProperty flags, uint8_t large) {
+    pte_t entry = flags & 0xFFF & ~(PAGE_4MB | PAGE_PAT | PAGE_EXECUTE_DISABLE);
+    if (flags & PAGE_PAT) {
+        entry |= large ? PAGING_PDE_PAT : PAGING_PTE_PAT;
+    }
+    if ((flags & PAGE_EXECUTE_DISABLE) && paging_nx) {
+        entry |= PAGING_PTE_NX;
+    }
+    return large ? entry | PAGE_4MB : entry;
+}
 
-    // Load the page directory address into CR3
-    enable_paging(page_directory);
+// Map one frame at a fixed address, for editing memory that is not mapped
+// anywhere else yet. The mapping lasts until the next call.
+static pte_t *paging_fixmap(phys_addr_t phys_addr) {
+    if (!(page_directory[PAGING_FIXMAP_SLOT] & PAGING_PAGE_PRESENT)) {
+        page_directory[PAGING_FIXMAP_SLOT] = KERNEL_PHYS(paging_fixmap_table) | (PAGING_PAGE_PRESENT | PAGING_PAGE_RW);
+    }
+    paging_fixmap_table[0] = (phys_addr & PAGING_FRAME_MASK) | (PAGING_PAGE_PRESENT | PAGING_PAGE_RW);
+    asm("invlpg (%0)" : : "r" (PAGING_FIXMAP_BASE) : "memory");
+    return (pte_t *)PAGING_FIXMAP_BASE;
+}
 
-    terminal_printf("Paging enabled successfully.\n");
+// Replace a large page with a table of 4 KiB pages mapping the same range,
+// so part of it can be remapped. The table is filled through the fixmap
+// before it goes live, as the range may hold the very code doing the split.
+// NULL if no frame is left for the table.
+static pte_t *paging_split_large(uint32_t pd_index) {
+    pte_t pde = page_directory[pd_index];
+    uint32_t table_frame = frame_alloc_page();
+    if (table_frame == FRAME_NONE) {
+        return NULL;
+    }
+    pte_t *page_table = paging_fixmap(table_frame);
+    pte_t base = pde & PAGING_LARGE_FRAME_MASK;
+    pte_t flags = (pde & (0xFFF | PAGING_PTE_NX) & ~(pte_t)PAGE_4MB) | ((pde & PAGING_PDE_PAT) ? PAGING_PTE_PAT : 0);
+    for (uint32_t i = 0; i < NUM_ENTRIES; i++) {
+        page_table[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    page_directory[pd_index] = table_frame | (PAGING_PAGE_PRESENT | PAGING_PAGE_RW);
+    asm("invlpg (%0)" : : "r" (pd_index << PAGING_DIR_SHIFT) : "memory");
+    asm("invlpg (%0)" : : "r" (PAGING_TABLE(pd_index)) : "memory");
+    return PAGING_TABLE(pd_index);
 }
 
 // ---------------------------------------------------------------------------
 // set_page_mapping: Maps a single page at virtual address 'virt_addr' to physical address 'phys_addr'
 // with the given flags. Allocates a new page table if needed.
 // ---------------------------------------------------------------------------
-void set_page_mapping(uint32_t virt_addr, uint32_t phys_addr, PageProperty flags) {
-    // Calculate page directory index (top 10 bits) and page table index (next 10 bits)
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-    uint32_t* page_table;
+void set_page_mapping(uint32_t virt_addr, phys_addr_t phys_addr, PageProperty flags) {
+    // Calculate page directory index and page table index
+    uint32_t pd_index = virt_addr >> PAGING_DIR_SHIFT;
+    uint32_t pt_index = (virt_addr >> 12) & (NUM_ENTRIES - 1);
+    pte_t* page_table = PAGING_TABLE(pd_index);
 
     // Check if the page directory entry is present
     if (!(page_directory[pd_index] & PAGING_PAGE_PRESENT)) {
-        // Allocate a new page table (must be PAGE_SIZE bytes, page aligned)
-        page_table = (uint32_t*)mem_alloc_aligned(PAGE_SIZE, PAGE_SIZE);
-        if (page_table == NULL) {
+        // A whole cleared frame, page aligned by construction, which shows
+        // up in the recursive window as soon as the directory points at it
+        uint32_t page_table_frame = frame_alloc_zeroed();
+        if (page_table_frame == FRAME_NONE) {
             // Handle allocation failure as needed.
             return;
         }
-        memset(page_table, 0, PAGE_SIZE);
-
-        // The physical address of the new page table: here we assume identity mapping for simplicity.
-        // In a real system, you'd need a function to convert a virtual address from mem_alloc to its physical address.
-        uint32_t pt_phys_addr = (uint32_t)page_table;
-        // Set the page directory entry: lower 12 bits used for flags.
-        page_directory[pd_index] = (pt_phys_addr & 0xFFFFF000) | (PAGING_PAGE_PRESENT | PAGING_PAGE_RW);
-    } else {
-        // Get the base address of the existing page table.
-        page_table = (uint32_t*)(page_directory[pd_index] & 0xFFFFF000);
+        page_directory[pd_index] = page_table_frame | (PAGING_PAGE_PRESENT | PAGING_PAGE_RW);
+        asm("invlpg (%0)" : : "r" (page_table) : "memory");
+    } else if (page_directory[pd_index] & PAGE_4MB) {
+        page_table = paging_split_large(pd_index);
+        if (page_table == NULL) {
+            return;
+        }
     }
     // Set the page table entry mapping virt_addr to phys_addr with provided flags.
-    page_table[pt_index] = (phys_addr & 0xFFFFF000) | (flags & 0xFFF);
+    page_table[pt_index] = (phys_addr & PAGING_FRAME_MASK) | paging_entry_flags(flags, 0);
+}
+
+void paging_map_range(uint32_t virt_addr, phys_addr_t phys_addr, uint32_t size, PageProperty flags) {
+    uint32_t pages = (size + PAGE_SIZE - 1) >> 12;
+    virt_addr &= 0xFFFFF000;
+    phys_addr &= PAGING_FRAME_MASK;
+
+    while (pages != 0) {
+        pte_t pde = page_directory[virt_addr >> PAGING_DIR_SHIFT];
+        uint8_t large = ((virt_addr | phys_addr) & (PAGING_LARGE_PAGE_SIZE - 1)) == 0 &&
+            pages >= NUM_ENTRIES && (!(pde & PAGING_PAGE_PRESENT) || (pde & PAGE_4MB));
+        if (large) {
+            // A table already there keeps its other mappings, so it stays
+            page_directory[virt_addr >> PAGING_DIR_SHIFT] = phys_addr | paging_entry_flags(flags, 1);
+        } else {
+            set_page_mapping(virt_addr, phys_addr, flags);
+        }
+        asm("invlpg (%0)" : : "r" (virt_addr) : "memory");
+
+        uint32_t step = large ? NUM_ENTRIES : 1;
+        pages -= step;
+        virt_addr += step << 12;
+        phys_addr += step << 12;
+    }
 }
 
 // ---------------------------------------------------------------------------
-// unmap_page: Unmaps a single page at the given virtual address.
+// virt_to_phys: Physical address behind 'virt_addr', PAGING_NO_MAPPING if it is not mapped.
 // ---------------------------------------------------------------------------
-void unmap_page(void* virtualaddr) {
-    uint32_t pd_index = (uint32_t)virtualaddr >> 22;
-    uint32_t pt_index = ((uint32_t)virtualaddr >> 12) & 0x3FF;
-    uint32_t* page_table = (uint32_t*)(page_directory[pd_index] & 0xFFFFF000);
+phys_addr_t virt_to_phys(uint32_t virt_addr) {
+    pte_t pde = page_directory[virt_addr >> PAGING_DIR_SHIFT];
+    if (!(pde & PAGING_PAGE_PRESENT)) {
+        return PAGING_NO_MAPPING;
+    }
+    if (pde & PAGE_4MB) {
+        return (pde & PAGING_LARGE_FRAME_MASK) | (virt_addr & (PAGING_LARGE_PAGE_SIZE - 1));
+    }
+    pte_t pte = PAGING_PTE(virt_addr);
+    if (!(pte & PAGING_PAGE_PRESENT)) {
+        return PAGING_NO_MAPPING;
+    }
+    return (pte & PAGING_FRAME_MASK) | (virt_addr & 0xFFF);
+}
 
-    // Mark the page as not present
+pte_t paging_get_entry(uint32_t virt_addr) {
+    pte_t pde = page_directory[virt_addr >> PAGING_DIR_SHIFT];
+    if (!(pde & PAGING_PAGE_PRESENT) || (pde & PAGE_4MB)) {
+        return pde;
+    }
+    return PAGING_PTE(virt_addr);
+}
+
+pte_t paging_clear_entry(uint32_t virt_addr) {
+    uint32_t pd_index = virt_addr >> PAGING_DIR_SHIFT;
+    uint32_t pt_index = (virt_addr >> 12) & (NUM_ENTRIES - 1);
+    if (!(page_directory[pd_index] & PAGING_PAGE_PRESENT)) {
+        return 0;
+    }
+    pte_t* page_table = (page_directory[pd_index] & PAGE_4MB) ? paging_split_large(pd_index) :
+        PAGING_TABLE(pd_index);
+    if (page_table == NULL) {
+        return 0;
+    }
+    pte_t old_entry = page_table[pt_index];
     page_table[pt_index] = 0;
+    return old_entry;
+}
 
-    // Invalidate the TLB for the unmapped page
-    asm("invlpg (%0)" : : "r" (virtualaddr) : "memory");
+// ---------------------------------------------------------------------------
+// unmap_page: Unmaps a single page at the given virtual address. Use a
+// tlb_gather_t to unmap many pages with one flush.
+// ---------------------------------------------------------------------------
+void unmap_page(void* virtualaddr) {
+    if (paging_clear_entry((uint32_t)virtualaddr) & PAGING_PAGE_PRESENT) {
+        paging_stats.unmapped_pages++;
+        flush_tlb_range((uint32_t)virtualaddr, (uint32_t)virtualaddr + PAGE_SIZE);
+    }
 }
+// ---------------------------------------------------------------------------
+// paging_benchmark: What a TLB miss after a CR3 reload costs, what global
+// pages save, and what invlpg costs next to a full flush.
+//
+// The same frame is mapped at PAGING_BENCH_PAGES fixmap pages, which are
+// touched once each right after every reload, first mapped as ordinary and
+// then as global pages. Only the virtual pages matter to the TLB, so one
+// frame is enough.
+// ---------------------------------------------------------------------------
+static uint32_t paging_bench_touch(uint8_t reload) {
+    volatile uint8_t *base = (volatile uint8_t *)(PAGING_FIXMAP_BASE + PAGE_SIZE);
+    uint32_t cycles = 0;
+    for (uint32_t round = 0; round < PAGING_BENCH_ROUNDS; round++) {
+        if (reload) {
+            load_cr3(PAGING_ROOT);
+        }
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < PAGING_BENCH_PAGES; i++) {
+            (void)base[i * PAGE_SIZE];
+        }
+        cycles += (uint32_t)(rdtsc() - start);
+    }
+    return cycles / (PAGING_BENCH_ROUNDS * PAGING_BENCH_PAGES);
+}
+
+void paging_benchmark() {
+    uint32_t frame = frame_alloc_page();
+    if (frame == FRAME_NONE) {
+        terminal_printf("Error: No frame for the TLB benchmark.\n");
+        return;
+    }
+    paging_fixmap(frame);
+
+    uint32_t results[2][2];
+    uintptr_t flags = irq_save();
+    for (uint32_t global = 0; global < 2; global++) {
+        for (uint32_t i = 1; i <= PAGING_BENCH_PAGES; i++) {
+            paging_fixmap_table[i] = frame | (global ? PAGE_SYSGLOBAL : PAGE_SYSDEFAULT);
+            asm("invlpg (%0)" : : "r" (PAGING_FIXMAP_BASE + i * PAGE_SIZE) : "memory");
+        }
+        paging_bench_touch(0);
+        results[global][0] = paging_bench_touch(0);
+        results[global][1] = paging_bench_touch(1);
+    }
+
+    // What TLB_FLUSH_CEILING weighs: invlpg per page against one full flush
+    uint64_t start = rdtsc();
+    for (uint32_t i = 1; i <= PAGING_BENCH_PAGES; i++) {
+        asm("invlpg (%0)" : : "r" (PAGING_FIXMAP_BASE + i * PAGE_SIZE) : "memory");
+    }
+    uint32_t invlpg_cycles = (uint32_t)(rdtsc() - start) / PAGING_BENCH_PAGES;
+    start = rdtsc();
+    load_cr3(PAGING_ROOT);
+    uint32_t reload_cycles = (uint32_t)(rdtsc() - start);
+    for (uint32_t i = 1; i <= PAGING_BENCH_PAGES; i++) {
+        paging_fixmap_table[i] = 0;
+        asm("invlpg (%0)" : : "r" (PAGING_FIXMAP_BASE + i * PAGE_SIZE) : "memory");
+    }
+    irq_restore(flags);
+    frame_free_page(frame);
+
+    terminal_printf("TLB, cycles per page over %u pages:%s\n", PAGING_BENCH_PAGES, paging_pge ? "" : " (no PGE)");
+    terminal_printf("  no reload: %u normal, %u global\n", results[0][0], results[1][0]);
+    terminal_printf("  after CR3 reload: %u normal, %u global\n", results[0][1], results[1][1]);
+    terminal_printf("  invlpg %u cycles per page, CR3 reload %u cycles, full flush past %u pages\n",
+        invlpg_cycles, reload_cycles, TLB_FLUSH_CEILING);
+}
+
 
 
 
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "pat.h"
+#include "paging.h"
+#include "terminal.h"
+#include "io.h"
+
+static uint8_t pat_available = 0;
+static uint8_t mtrr_available = 0;
+static uint8_t mtrr_phys_bits = 36; // Physical address width, sizes the MTRR masks
+
+// ---------------------------------------------------------------------------
+// Page attribute table
+// ---------------------------------------------------------------------------
+void pat_initialize() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    pat_available = (edx & CPUID_1_EDX_PAT) != 0;
+    mtrr_available = (edx & CPUID_1_EDX_MTRR) != 0;
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000008) {
+        cpuid(0x80000008, 0, &eax, &ebx, &ecx, &edx);
+        mtrr_phys_bits = eax & 0xFF;
+    }
+
+    // Nothing has set the PAT bit in an entry yet, so slot 4 can change
+    // without flushing anything
+    if (pat_available) {
+        cpuSetMSR(IA32_PAT_MSR, PAT_VALUE_LOW, PAT_VALUE_HIGH);
+    }
+}
+
+bool pat_enabled() {
+    return pat_available;
+}
+
+uint32_t pat_page_flags(cache_type_t type) {
+    switch (type) {
+        case CACHE_WB:       return 0;
+        case CACHE_WT:       return PAGE_PWT;
+        case CACHE_UC_MINUS: return PAGE_PCD;
+        // Without the table, UC- pages let a WC MTRR over them win
+        case CACHE_WC:       return pat_available ? PAGE_PAT : PAGE_PCD;
+        default:             return PAGE_PCD | PAGE_PWT;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Variable range MTRRs
+// ---------------------------------------------------------------------------
+
+// Largest naturally aligned power of two piece starting at 'base' that fits in 'size'
+static uint64_t mtrr_piece(uint64_t base, uint64_t size) {
+    uint64_t piece = base ? (base & (~base + 1)) : (1ULL << 63);
+    while (piece > size) {
+        piece >>= 1;
+    }
+    return piece;
+}
+
+static inline void mtrr_flush() {
+    uint32_t cr3;
+    asm("wbinvd" ::: "memory");
+    asm("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
+
+bool mtrr_set_range(uint64_t base, uint64_t size, cache_type_t type) {
+    if (!mtrr_available || size == 0) {
+        return false;
+    }
+    uint32_t cap_low, cap_high;
+    cpuGetMSR(IA32_MTRRCAP_MSR, &cap_low, &cap_high);
+    if (type == CACHE_WC && !(cap_low & MTRRCAP_WC)) {
+        return false;
+    }
+    uint32_t count = cap_low & MTRRCAP_VCNT_MASK;
+
+    size = (size + (base & (PAGING_PAGE_SIZE - 1)) + PAGING_PAGE_SIZE - 1) & ~(uint64_t)(PAGING_PAGE_SIZE - 1);
+    base &= ~(uint64_t)(PAGING_PAGE_SIZE - 1);
+
+    // Check there are enough free MTRRs before touching any
+    uint32_t free = 0, pieces = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t mask_low, mask_high;
+        cpuGetMSR(IA32_MTRR_PHYSMASK_MSR(i), &mask_low, &mask_high);
+        free += !(mask_low & MTRR_PHYSMASK_VALID);
+    }
+    for (uint64_t at = base, left = size; left != 0; pieces++) {
+        uint64_t piece = mtrr_piece(at, left);
+        at += piece;
+        left -= piece;
+    }
+    if (pieces > free) {
+        return false;
+    }
+
+    // The update sequence from the SDM: caches off and flushed, MTRRs off
+    // while they change
+    uintptr_t flags = irq_save();
+    uint32_t cr0;
+    asm("mov %%cr0, %0" : "=r"(cr0));
+    asm("mov %0, %%cr0" :: "r"((cr0 | 0x40000000) & ~0x20000000) : "memory"); // CD on, NW off
+    mtrr_flush();
+    uint32_t def_low, def_high;
+    cpuGetMSR(IA32_MTRR_DEF_TYPE_MSR, &def_low, &def_high);
+    cpuSetMSR(IA32_MTRR_DEF_TYPE_MSR, def_low & ~MTRR_DEF_TYPE_ENABLE, def_high);
+
+    uint64_t phys_mask = (1ULL << mtrr_phys_bits) - 1;
+    uint32_t slot = 0;
+    for (uint64_t at = base, left = size; left != 0;) {
+        uint64_t piece = mtrr_piece(at, left);
+        for (;; slot++) {
+            uint32_t mask_low, mask_high;
+            cpuGetMSR(IA32_MTRR_PHYSMASK_MSR(slot), &mask_low, &mask_high);
+            if (!(mask_low & MTRR_PHYSMASK_VALID)) {
+                break;
+            }
+        }
+
+        uint64_t mask = ~(piece - 1) & phys_mask;
+        cpuSetMSR(IA32_MTRR_PHYSBASE_MSR(slot), (uint32_t)at | type, (uint32_t)(at >> 32));
+        cpuSetMSR(IA32_MTRR_PHYSMASK_MSR(slot), ((uint32_t)mask & 0xFFFFF000) | MTRR_PHYSMASK_VALID,
+            (uint32_t)(mask >> 32));
+        at += piece;
+        left -= piece;
+    }
+
+    mtrr_flush();
+    cpuSetMSR(IA32_MTRR_DEF_TYPE_MSR, def_low, def_high);
+    asm("mov %0, %%cr0" :: "r"(cr0) : "memory");
+    irq_restore(flags);
+    return true;
+}
+
+void pat_print_info() {
+    terminal_printf("PAT: %s", pat_available ? "slot 4 write-combining" : "not supported");
+    if (mtrr_available) {
+        uint32_t cap_low, cap_high, used = 0;
+        cpuGetMSR(IA32_MTRRCAP_MSR, &cap_low, &cap_high);
+        for (uint32_t i = 0; i < (cap_low & MTRRCAP_VCNT_MASK); i++) {
+            uint32_t mask_low, mask_high;
+            cpuGetMSR(IA32_MTRR_PHYSMASK_MSR(i), &mask_low, &mask_high);
+            used += (mask_low & MTRR_PHYSMASK_VALID) != 0;
+        }
+        terminal_printf(", MTRR: %u of %u variable ranges used\n", used, cap_low & MTRRCAP_VCNT_MASK);
+    } else {
+        terminal_printf(", MTRR: not supported\n");
+    }
+}
@@ -0,0 +1,253 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "slab.h"
+#include "memory.h"
+#include "frame.h"
+#include "terminal.h"
+#include "io.h"
+
+static slab_cache_t *slab_caches = NULL;
+
+// Index of the running CPU into the per-CPU magazines
+static inline uint32_t slab_cpu() {
+    return 0;
+}
+
+static inline uint32_t slab_size(slab_cache_t *cache) {
+    return FRAME_SIZE << cache->order;
+}
+
+// ---------------------------------------------------------------------------
+// Slab lists
+// ---------------------------------------------------------------------------
+static void slab_list_push(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static slab_t *slab_create(slab_cache_t *cache) {
+    uint32_t phys = frame_alloc(cache->order);
+    if (phys == FRAME_NONE) {
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t *)(uintptr_t)phys;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_top = cache->per_slab;
+
+    // Lowest index on top, so a fresh slab is handed out front to back
+    uint8_t *objects = (uint8_t *)slab + cache->first_offset;
+    for (uint16_t i = 0; i < cache->per_slab; i++) {
+        slab->free_index[i] = cache->per_slab - 1 - i;
+        if (cache->ctor != NULL) {
+            cache->ctor(objects + i * cache->object_size);
+        }
+    }
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_destroy(slab_cache_t *cache, slab_t *slab) {
+    frame_free((uint32_t)(uintptr_t)slab, cache->order);
+    cache->slab_count--;
+}
+
+// One object straight from the slab lists
+static void *slab_take(slab_cache_t *cache) {
+    slab_t *slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        cache->empty = NULL;
+        if (slab == NULL) {
+            slab = slab_create(cache);
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    uint16_t index = slab->free_index[--slab->free_top];
+    if (++slab->in_use == cache->per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    return (uint8_t *)slab + cache->first_offset + index * cache->object_size;
+}
+
+// Put an object back into its slab
+static void slab_put(slab_cache_t *cache, void *object) {
+    slab_t *slab = (slab_t *)((uintptr_t)object & ~(uintptr_t)(slab_size(cache) - 1));
+    uint32_t offset = (uint8_t *)object - (uint8_t *)slab - cache->first_offset;
+
+    if (slab->in_use-- == cache->per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    slab->free_index[slab->free_top++] = offset / cache->object_size;
+
+    // Keep one empty slab around, so a cache that hovers at a slab boundary
+    // does not hit the frame allocator on every other call
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Caches
+// ---------------------------------------------------------------------------
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *object)) {
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+        align = SLAB_CACHE_LINE;
+    }
+    if (size == 0 || align > FRAME_SIZE) {
+        return NULL;
+    }
+    uint32_t object_size = (size + align - 1) & ~(align - 1);
+
+    // Smallest slab that holds SLAB_MIN_OBJECTS, or the largest allowed
+    uint32_t order, per_slab = 0, first_offset = 0;
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        uint32_t bytes = FRAME_SIZE << order;
+        per_slab = (bytes - sizeof(slab_t)) / (object_size + sizeof(uint16_t));
+        while (per_slab != 0) {
+            first_offset = (sizeof(slab_t) + per_slab * sizeof(uint16_t) + align - 1) & ~(align - 1);
+            if (first_offset + per_slab * object_size <= bytes) {
+                break;
+            }
+            --per_slab;
+        }
+        if (per_slab >= SLAB_MIN_OBJECTS || (order == SLAB_MAX_ORDER && per_slab != 0)) {
+            break;
+        }
+    }
+    if (per_slab == 0) {
+        return NULL;
+    }
+
+    slab_cache_t *cache = memalloc_tagged(sizeof(slab_cache_t), MEM_TAG_KERNEL);
+    if (cache == (void *)0xFFFFFFFF) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(slab_cache_t));
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->align = align;
+    cache->order = order;
+    cache->first_offset = first_offset;
+    cache->per_slab = per_slab;
+    cache->ctor = ctor;
+
+    cache->next = slab_caches;
+    slab_caches = cache;
+    return cache;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    uintptr_t flags = irq_save();
+    slab_magazine_t *magazine = &cache->magazines[slab_cpu()];
+    void *object;
+
+    if (magazine->count != 0) {
+        cache->magazine_hits++;
+        object = magazine->objects[--magazine->count];
+    } else {
+        // Refill half the magazine while the slab lists are at hand
+        cache->magazine_misses++;
+        object = slab_take(cache);
+        while (object != NULL && magazine->count < SLAB_MAGAZINE_SIZE / 2) {
+            void *extra = slab_take(cache);
+            if (extra == NULL) {
+                break;
+            }
+            magazine->objects[magazine->count++] = extra;
+        }
+    }
+
+    if (object != NULL) {
+        cache->objects_in_use++;
+    }
+    irq_restore(flags);
+    return object != NULL ? object : (void *)0xFFFFFFFF;
+}
+
+void slab_free(slab_cache_t *cache, void *object) {
+    if (object == NULL || object == (void *)0xFFFFFFFF) {
+        return;
+    }
+
+    uintptr_t flags = irq_save();
+    slab_magazine_t *magazine = &cache->magazines[slab_cpu()];
+    if (magazine->count == SLAB_MAGAZINE_SIZE) {
+        // Full, send the older half back to the slabs
+        for (uint32_t i = 0; i < SLAB_MAGAZINE_SIZE / 2; i++) {
+            slab_put(cache, magazine->objects[i]);
+        }
+        for (uint32_t i = SLAB_MAGAZINE_SIZE / 2; i < SLAB_MAGAZINE_SIZE; i++) {
+            magazine->objects[i - SLAB_MAGAZINE_SIZE / 2] = magazine->objects[i];
+        }
+        magazine->count -= SLAB_MAGAZINE_SIZE / 2;
+    }
+    magazine->objects[magazine->count++] = object;
+    cache->objects_in_use--;
+    irq_restore(flags);
+}
+
+void slab_cache_shrink(slab_cache_t *cache) {
+    uintptr_t flags = irq_save();
+    for (uint32_t cpu = 0; cpu < SLAB_MAX_CPUS; cpu++) {
+        slab_magazine_t *magazine = &cache->magazines[cpu];
+        while (magazine->count != 0) {
+            slab_put(cache, magazine->objects[--magazine->count]);
+        }
+    }
+    if (cache->empty != NULL) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+    irq_restore(flags);
+}
+
+void slab_cache_destroy(slab_cache_t *cache) {
+    slab_cache_shrink(cache);
+    if (cache->partial != NULL || cache->full != NULL) {
+        terminal_printf("Warning: Cache %s destroyed with %u objects in use\n", cache->name, cache->objects_in_use);
+        return;
+    }
+
+    slab_cache_t **link = &slab_caches;
+    while (*link != cache) {
+        link = &(*link)->next;
+    }
+    *link = cache->next;
+    memfree(cache);
+}
+
+void slab_print_stats() {
+    for (slab_cache_t *cache = slab_caches; cache != NULL; cache = cache->next) {
+        terminal_printf("  %s: %u B objects, %u in use, %u slabs of %u, magazine %u hits %u misses\n",
+            cache->name, cache->object_size, cache->objects_in_use, cache->slab_count, cache->per_slab,
+            cache->magazine_hits, cache->magazine_misses);
+    }
+}
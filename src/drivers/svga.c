@@ -40,8 +40,8 @@ void RenderFrame0() {
         uint32_t framebuffer_value = convert_rgb_to_framebuffer(make_svga_color(0x7F, 0x7F, 0x7F));
         framebuffer_value |= ALPHA_MASK;
 
-        memset_pattern((void *)fbo_com_gb.framebuffer_addr, &framebuffer_value, (size_t)(fbo_com_gb.framebuffer_bpp|7)>>3, 
-        (fbo_com_gb.framebuffer_width * fbo_com_gb.framebuffer_width * ((fbo_com_gb.framebuffer_bpp|7)>>3)));
+        memset_pattern_stream((void *)fbo_com_gb.framebuffer_addr, &framebuffer_value, (size_t)(fbo_com_gb.framebuffer_bpp|7)>>3, 
+        (fbo_com_gb.framebuffer_width * fbo_com_gb.framebuffer_height * ((fbo_com_gb.framebuffer_bpp|7)>>3)));
         draw_filled_quad(make_svga_color(255, 255, 0), 
         make_uint16_vector2(30, 20), // Top-Left
         make_uint16_vector2(fbo_com_gb.framebuffer_width-30, 20), // Top-Right
@@ -157,7 +157,7 @@ void draw_rect(color_t color, uint16_Vector2_t pos, uint16_Vector2_t size) {
 
     for (uint16_t y_in_c = pos.y; y_in_c < (pos.y + size.y); y_in_c++) {
         void *line_start = (uint8_t *)fbo_com_gb.framebuffer_addr + ((y_in_c * fbo_com_gb.framebuffer_width + pos.x) * bytes_per_pixel);
-        memset_pattern(line_start, &real_color, bytes_per_pixel, size.x * bytes_per_pixel);
+        memset_pattern_stream(line_start, &real_color, bytes_per_pixel, size.x * bytes_per_pixel);
     }
 }
 
@@ -222,7 +222,7 @@ void draw_filled_quad(color_t color, uint16_Vector2_t p1, uint16_Vector2_t p2,
                                ((y * fbo_com_gb.framebuffer_width + left) * bytes_per_pixel);
             int num_pixels = right - left;
             // Fill the line using memset_pattern (number of bytes = num_pixels * bytes_per_pixel).
-            memset_pattern(line_start, &real_color, bytes_per_pixel, num_pixels * bytes_per_pixel);
+            memset_pattern_stream(line_start, &real_color, bytes_per_pixel, num_pixels * bytes_per_pixel);
         }
     }
 }
@@ -231,6 +231,6 @@ void clear_screen(color_t color) {
     uint32_t framebuffer_value = convert_rgb_to_framebuffer(color);
     framebuffer_value |= ALPHA_MASK;
 
-    memset_pattern((void *)fbo_com_gb.framebuffer_addr, &framebuffer_value, (size_t)(fbo_com_gb.framebuffer_bpp|7)>>3, 
-    (fbo_com_gb.framebuffer_width * fbo_com_gb.framebuffer_width * ((fbo_com_gb.framebuffer_bpp|7)>>3)));
+    memset_pattern_stream((void *)fbo_com_gb.framebuffer_addr, &framebuffer_value, (size_t)(fbo_com_gb.framebuffer_bpp|7)>>3, 
+    (fbo_com_gb.framebuffer_width * fbo_com_gb.framebuffer_height * ((fbo_com_gb.framebuffer_bpp|7)>>3)));
 }
\ No newline at end of file
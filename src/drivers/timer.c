@@ -1,5 +1,6 @@
 #include "terminal.h"
 #include "timer.h"
+#include "clockevent.h"
 #include "pic_irq.h"
 #include "pic.h"
 #include "apic_irq.h"
@@ -8,29 +9,33 @@
 #include <stdint.h>
 
 // Timer and frequency definitions
-#define TIMER_TPS 125
 #define PIT_HZ 1193181
-#define DIV_OF_FREQ(_f) (PIT_HZ / (_f))
-#define FREQ_OF_DIV(_d) (PIT_HZ / (_d))
-#define REAL_FREQ_OF_FREQ(_f) (FREQ_OF_DIV(DIV_OF_FREQ((_f))))
 
 // PIT ports and commands
 #define PIT_COMMAND 0x43
 #define PIT_CHANNEL0 0x40
+#define PIT_ONESHOT 0x30                  // Channel 0, LSB/MSB, mode 0 (interrupt on terminal count)
 
 // APIC Timer registers
 #define APIC_TIMER_INIT_COUNT 0xFFFFFFFF  // Max initial count
+#define APIC_TIMER_ONESHOT    0x00000     // One-shot mode
 #define APIC_TIMER_PERIODIC   0x20000     // Periodic mode
+#define APIC_TIMER_TSC_DEADLINE 0x40000   // Fires when the TSC reaches IA32_TSC_DEADLINE
 #define APIC_TIMER_DIVIDE_64  0x06        // Divide by 64
 #define APIC_TIMER_IRQ_VECTOR 0x20        // IRQ vector
 #define APIC_TIMER_INITCNT    0x380       // Initial counter
 #define APIC_TIMER_CURRCNT    0x390       // Current counter
 #define APIC_TIMER_DIV        0x3E0       // Timer divide configuration
 
+#define MSR_IA32_TSC_DEADLINE 0x6E0
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+
 // Timer state variables
 uint32_t timer_ticks = 0;
-uint32_t timer_frequency = 0;
-uint32_t timer_divisor = 0;
+static uint32_t timer_apic_mult = 0;     // Nanoseconds to APIC counts, CLOCK_SCALE_SHIFT
+static uint32_t timer_pit_mult = 0;      // Nanoseconds to PIT counts, shift 32
+static bool timer_pit_events = false;    // The PIT was registered for clock events
+static volatile bool timer_pit_borrowed = false; // A PIT sleep has channel 0
 
 void timer_pic_set_pit_frequency(uint32_t frequency) {
     if (frequency == 0) {
@@ -56,19 +61,97 @@ void timer_pic_set_pit_frequency(uint32_t frequency) {
 
 void timer_handler(Registers* regs) {
     (void)regs;  // Prevent unused parameter warning
-    ++timer_ticks;
+    clockevent_interrupt();
+}
+
+// ---------------------------------------------------------------------------
+// Clock event devices
+//
+// All of them run one-shot and are armed for the next timer only. The PIT
+// is shared with the PIT sleeps, which run it in mode 2. While one has it
+// the device leaves the channel alone, the sleep's interrupts only find
+// nothing due, and the next timer is armed again once the sleep is over.
+// ---------------------------------------------------------------------------
+static bool timer_tsc_deadline_set_next(uint64_t delta_ns) {
+    // A deadline that has already passed fires at once
+    uint64_t deadline = rdtsc() + clock_ns_to_cycles(delta_ns);
+    cpuSetMSR(MSR_IA32_TSC_DEADLINE, (uint32_t)deadline, (uint32_t)(deadline >> 32));
+    return true;
+}
+
+static void timer_tsc_deadline_stop() {
+    cpuSetMSR(MSR_IA32_TSC_DEADLINE, 0, 0);
+}
+
+static bool timer_apic_set_next(uint64_t delta_ns) {
+    uint64_t count = clock_scale(delta_ns, timer_apic_mult, CLOCK_SCALE_SHIFT);
+    APIC_Write(APIC_TIMER_INITCNT, (uint32_t)MAX(MIN(count, 0xFFFFFFFFULL), 1ULL));
+    return true;
 }
 
+static void timer_apic_stop() {
+    APIC_Write(APIC_TIMER_INITCNT, 0);
+}
+
+static bool timer_pit_set_next(uint64_t delta_ns) {
+    if (timer_pit_borrowed) {
+        return true;
+    }
+    uint64_t count = clock_scale(delta_ns, timer_pit_mult, 32);
+    count = MAX(MIN(count, 0xFFFFULL), 1ULL);
+    outb(PIT_COMMAND, PIT_ONESHOT);
+    outb(PIT_CHANNEL0, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)(count >> 8));
+    return true;
+}
+
+static void timer_pit_stop() {
+    // Mode 0 holds off until a count is written
+    if (!timer_pit_borrowed) {
+        outb(PIT_COMMAND, PIT_ONESHOT);
+    }
+}
+
+static clockevent_device_t timer_tsc_deadline_device = {
+    .name = "TSC-deadline",
+    .rating = 400,
+    .min_delta_ns = 1000,
+    .max_delta_ns = CLOCK_NS_PER_SEC,
+    .set_next = timer_tsc_deadline_set_next,
+    .stop = timer_tsc_deadline_stop,
+};
+
+static clockevent_device_t timer_apic_device = {
+    .name = "APIC one-shot",
+    .rating = 300,
+    .min_delta_ns = 1000,
+    .max_delta_ns = CLOCK_NS_PER_SEC,
+    .set_next = timer_apic_set_next,
+    .stop = timer_apic_stop,
+};
+
+static clockevent_device_t timer_pit_device = {
+    .name = "PIT one-shot",
+    .rating = 100,
+    .min_delta_ns = 2000,
+    .max_delta_ns = 50000000,           // Under the 16-bit count's 54.9 ms
+    .set_next = timer_pit_set_next,
+    .stop = timer_pit_stop,
+};
+
 void timer_pic_init() {
-    const uint32_t freq = REAL_FREQ_OF_FREQ(TIMER_TPS);
-    timer_frequency = freq;
-    timer_divisor = DIV_OF_FREQ(freq);
+    clock_initialize();
     timer_ticks = 0;
-    timer_pic_set_pit_frequency(TIMER_TPS);
+    timer_pit_mult = (uint32_t)clock_div((uint64_t)PIT_HZ << 32, CLOCK_NS_PER_SEC);
+    timer_pit_stop();
     PIC_IRQ_RegisterHandler(0, (IRQHandler)timer_handler);
+    timer_pit_events = true;
+    clockevent_register(&timer_pit_device);
 }
 
 void timer_apic_init() {
+    clock_initialize();
+
     // Set APIC timer divider to 64
     APIC_Write(APIC_TIMER_DIV, APIC_TIMER_DIVIDE_64);
 
@@ -87,24 +170,33 @@ void timer_apic_init() {
 
     // Calculate APIC ticks per 10ms
     uint32_t ticksIn10ms = APIC_TIMER_INIT_COUNT - APIC_Read(APIC_TIMER_CURRCNT);
+    APIC_Write(APIC_TIMER_INITCNT, 0);
+    timer_apic_mult = (uint32_t)clock_div((uint64_t)ticksIn10ms << CLOCK_SCALE_SHIFT, 10000000);
 
-    // Configure APIC timer as periodic
-    APIC_Write(APIC_LVT_TIMER, APIC_TIMER_IRQ_VECTOR | APIC_TIMER_PERIODIC);
-    APIC_Write(APIC_TIMER_INITCNT, ticksIn10ms); // Set calibrated ticks
-
-    // Register and enable APIC timer IRQ
-    APIC_IRQ_RegisterHandler(APIC_TIMER_IRQ_VECTOR, timer_handler);
-    APIC_EnableIRQ(APIC_TIMER_IRQ_VECTOR);
-
-    // Unmask APIC timer interrupt
-    APIC_Write(APIC_LVT_TIMER, APIC_Read(APIC_LVT_TIMER) & ~APIC_LVT_INT_MASKED);
+    // The vector arrives as APIC IRQ 0
+    timer_ticks = 0;
     APIC_IRQ_RegisterHandler(0, (IRQHandler)timer_handler);
+
+    // Nothing is armed until there is a timer, so neither mode ticks by itself
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (ecx & CPUID_1_ECX_TSC_DEADLINE) {
+        APIC_Write(APIC_LVT_TIMER, APIC_TIMER_IRQ_VECTOR | APIC_TIMER_TSC_DEADLINE);
+        // The LVT write has to land before the first deadline write
+        asm("mfence" : : : "memory");
+        clockevent_register(&timer_tsc_deadline_device);
+    } else {
+        APIC_Write(APIC_LVT_TIMER, APIC_TIMER_IRQ_VECTOR | APIC_TIMER_ONESHOT);
+        clockevent_register(&timer_apic_device);
+    }
     terminal_printf("APIC Timer Initialized\n");
 }
 
 void pit_prepare_sleep(uint32_t microseconds) {
-    // Calculate divisor for PIT (avoid rounding errors)
-    uint16_t divisor = (uint16_t)((PIT_HZ * microseconds) / 1000000);
+    timer_pit_borrowed = timer_pit_events;
+
+    // Calculate divisor for PIT, the product does not fit in 32 bits
+    uint16_t divisor = (uint16_t)clock_div((uint64_t)PIT_HZ * microseconds, 1000000);
 
     // Configure PIT: Channel 0, Mode 2 (rate generator), Binary
     outb(PIT_COMMAND, 0x34);
@@ -137,4 +229,9 @@ void pit_perform_sleep() {
         }
         last_count = current_count;
     }
+    if (timer_pit_borrowed) {
+        timer_pit_borrowed = false;
+        timer_pit_stop();
+        clockevent_resume();
+    }
 }
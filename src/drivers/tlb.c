@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "tlb.h"
+#include "paging.h"
+#include "frame.h"
+#include "apic.h"
+#include "isr.h"
+#include "terminal.h"
+#include "io.h"
+
+#define PAGE_SIZE 4096
+
+volatile uint32_t tlb_cpus_online = 1;
+
+static struct {
+    uint32_t gathers;       // Gathers that had something to flush
+    uint32_t range_flushes; // flush_tlb_range calls
+    uint32_t invlpg_pages;
+    uint32_t cr3_reloads;   // Full flushes that kept global entries
+    uint32_t pge_toggles;   // Full flushes that dropped global entries too
+    uint32_t shootdowns;
+} tlb_stats;
+
+// ---------------------------------------------------------------------------
+// Local invalidation
+// ---------------------------------------------------------------------------
+void tlb_flush_all(bool global) {
+    uint32_t cr4;
+    asm("mov %%cr4, %0" : "=r"(cr4));
+    if (global && (cr4 & PAGING_CR4_PGE)) {
+        // Toggling PGE is the one way to drop global entries wholesale
+        asm("mov %0, %%cr4" : : "r"(cr4 & ~PAGING_CR4_PGE) : "memory");
+        asm("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        tlb_stats.pge_toggles++;
+    } else {
+        uint32_t cr3;
+        asm("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+        tlb_stats.cr3_reloads++;
+    }
+}
+
+static void tlb_flush_local(uint32_t start, uint32_t end, bool global) {
+    uint32_t pages = (end - start) >> 12;
+    if (pages > TLB_FLUSH_CEILING) {
+        tlb_flush_all(global);
+        return;
+    }
+    for (uint32_t addr = start; addr != end; addr += PAGE_SIZE) {
+        asm("invlpg (%0)" : : "r" (addr) : "memory");
+    }
+    tlb_stats.invlpg_pages += pages;
+}
+
+// ---------------------------------------------------------------------------
+// Shootdown
+//
+// One request at a time: the sender fills it in, sends the IPI to every
+// other CPU and spins until they have all flushed. Callers must not hold
+// interrupts off while another CPU might be doing the same.
+// ---------------------------------------------------------------------------
+static volatile uint32_t tlb_shootdown_lock = 0;
+static volatile uint32_t tlb_shootdown_pending = 0;
+static volatile struct {
+    uint32_t start;
+    uint32_t end;
+    bool global;
+} tlb_request;
+
+static void tlb_shootdown_handler(Registers *regs) {
+    (void)regs;
+    tlb_flush_local(tlb_request.start, tlb_request.end, tlb_request.global);
+    atomic_add(&tlb_shootdown_pending, (uint32_t)-1);
+    LAPIC_SendEOI();
+}
+
+static void tlb_shootdown(uint32_t start, uint32_t end, bool global) {
+    if (tlb_cpus_online <= 1) {
+        return;
+    }
+    while (atomic_xchg(&tlb_shootdown_lock, 1) != 0) {
+        asm("pause");
+    }
+    tlb_request.start = start;
+    tlb_request.end = end;
+    tlb_request.global = global;
+    tlb_shootdown_pending = tlb_cpus_online - 1;
+
+    APIC_Write(APIC_ICR_HIGH, 0);
+    APIC_Write(APIC_ICR_LOW, APIC_ICR_ALL_BUT_SELF | APIC_DELIVERY_MODE_FIXED | TLB_SHOOTDOWN_VECTOR);
+    while (tlb_shootdown_pending != 0) {
+        asm("pause");
+    }
+    tlb_stats.shootdowns++;
+    atomic_xchg(&tlb_shootdown_lock, 0);
+}
+
+void tlb_initialize() {
+    ISR_RegisterHandler(TLB_SHOOTDOWN_VECTOR, (ISRHandler)tlb_shootdown_handler);
+}
+
+// ---------------------------------------------------------------------------
+// flush_tlb_range: Flush TLB entries for the virtual address range [start, end),
+// on every CPU. Callers do not say whether the range was global, so past the
+// ceiling global entries go too.
+// ---------------------------------------------------------------------------
+void flush_tlb_range(uint32_t start, uint32_t end) {
+    start &= 0xFFFFF000;
+    end = (end + PAGE_SIZE - 1) & 0xFFFFF000;
+    tlb_stats.range_flushes++;
+    tlb_flush_local(start, end, true);
+    tlb_shootdown(start, end, true);
+}
+
+// ---------------------------------------------------------------------------
+// Gathers
+// ---------------------------------------------------------------------------
+void tlb_gather_init(tlb_gather_t *gather) {
+    gather->start = 0;
+    gather->end = 0;
+    gather->global = 0;
+    gather->frame_count = 0;
+}
+
+static void tlb_gather_add(tlb_gather_t *gather, uint32_t virt, pte_t old_entry) {
+    virt &= 0xFFFFF000;
+    if (gather->start == gather->end) {
+        gather->start = virt;
+        gather->end = virt + PAGE_SIZE;
+    } else {
+        gather->start = MIN(gather->start, virt);
+        gather->end = MAX(gather->end, virt + PAGE_SIZE);
+    }
+    gather->global |= (old_entry & PAGE_GLOBAL) != 0;
+}
+
+void tlb_gather_unmap(tlb_gather_t *gather, uint32_t virt, bool free_frame) {
+    pte_t old_entry = paging_clear_entry(virt);
+    if (!(old_entry & PAGING_PAGE_PRESENT)) {
+        return;
+    }
+    tlb_gather_add(gather, virt, old_entry);
+    if (free_frame) {
+        if (gather->frame_count == TLB_GATHER_FRAMES) {
+            tlb_gather_flush(gather);
+        }
+        gather->frames[gather->frame_count++] = old_entry & PAGING_FRAME_MASK;
+    }
+}
+
+void tlb_gather_map(tlb_gather_t *gather, uint32_t virt, phys_addr_t phys, PageProperty flags) {
+    pte_t old_entry = paging_get_entry(virt);
+    set_page_mapping(virt, phys, flags);
+    if (old_entry & PAGING_PAGE_PRESENT) {
+        tlb_gather_add(gather, virt, old_entry);
+    }
+}
+
+void tlb_gather_flush(tlb_gather_t *gather) {
+    if (gather->start != gather->end) {
+        tlb_flush_local(gather->start, gather->end, gather->global);
+        tlb_shootdown(gather->start, gather->end, gather->global);
+        tlb_stats.gathers++;
+    }
+    // No CPU can reach these through a stale entry any more
+    for (uint32_t i = 0; i < gather->frame_count; i++) {
+        frame_free_high(gather->frames[i]);
+    }
+    tlb_gather_init(gather);
+}
+
+void tlb_print_stats() {
+    terminal_printf("TLB: %u gathers, %u range flushes, %u pages invalidated by invlpg\n",
+        tlb_stats.gathers, tlb_stats.range_flushes, tlb_stats.invlpg_pages);
+    terminal_printf("  full flushes: %u CR3 reloads, %u PGE toggles; %u shootdowns, %u CPUs\n",
+        tlb_stats.cr3_reloads, tlb_stats.pge_toggles, tlb_stats.shootdowns, tlb_cpus_online);
+}
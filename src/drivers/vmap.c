@@ -0,0 +1,282 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmap.h"
+#include "paging.h"
+#include "frame.h"
+#include "tlb.h"
+#include "terminal.h"
+#include "io.h"
+
+#define PAGE_SIZE 4096
+
+static vmap_area_t vmap_nodes[VMAP_MAX_AREAS];
+static vmap_area_t *vmap_areas = NULL;      // Every area in the window, lowest first
+static vmap_area_t *vmap_spare = NULL;      // Nodes not describing anything
+
+static struct {
+    uint32_t ioremap_maps;      // Device ranges that needed a new area
+    uint32_t ioremap_hits;      // Device ranges an existing area already covered
+    uint32_t vmalloc_pages;     // Frames behind vmalloc areas
+    uint32_t failed;            // No window space or no node left
+} vmap_stats;
+
+void vmap_initialize() {
+    for (uint32_t i = 0; i < VMAP_MAX_AREAS - 1; i++) {
+        vmap_nodes[i].next = &vmap_nodes[i + 1];
+    }
+    vmap_nodes[VMAP_MAX_AREAS - 1].next = NULL;
+    vmap_spare = &vmap_nodes[0];
+
+    vmap_areas = vmap_spare;
+    vmap_spare = vmap_spare->next;
+    vmap_areas->start = VMAP_BASE;
+    vmap_areas->size = VMAP_END - VMAP_BASE;
+    vmap_areas->kind = VMAP_FREE;
+    vmap_areas->next = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Areas
+// ---------------------------------------------------------------------------
+static vmap_area_t *vmap_node_get() {
+    vmap_area_t *node = vmap_spare;
+    if (node != NULL) {
+        vmap_spare = node->next;
+    }
+    return node;
+}
+
+static void vmap_node_put(vmap_area_t *node) {
+    node->next = vmap_spare;
+    vmap_spare = node;
+}
+
+// First free area that fits 'size' bytes starting on an 'align' boundary,
+// cut down to exactly that. The rest of the free area stays free on either
+// side, which takes up to two more nodes.
+static vmap_area_t *vmap_alloc(uint32_t size, uint32_t align, vmap_kind_t kind) {
+    vmap_area_t *before = vmap_node_get();
+    vmap_area_t *after = vmap_node_get();
+
+    vmap_area_t *area = vmap_areas;
+    for (; area != NULL; area = area->next) {
+        if (area->kind != VMAP_FREE || area->size < size) {
+            continue;
+        }
+        uint32_t start = (area->start + align - 1) & ~(align - 1);
+        if (start - area->start <= area->size - size) {
+            break;
+        }
+    }
+    if (area == NULL || before == NULL || after == NULL) {
+        if (before != NULL) {
+            vmap_node_put(before);
+        }
+        if (after != NULL) {
+            vmap_node_put(after);
+        }
+        vmap_stats.failed++;
+        return NULL;
+    }
+
+    uint32_t start = (area->start + align - 1) & ~(align - 1);
+    uint32_t area_end = area->start + area->size;
+    if (start != area->start) {
+        // 'area' keeps the gap below and 'before' becomes the new area
+        before->start = start;
+        before->next = area->next;
+        area->size = start - area->start;
+        area->next = before;
+        area = before;
+    } else {
+        vmap_node_put(before);
+    }
+    if (start + size != area_end) {
+        after->start = start + size;
+        after->size = area_end - (start + size);
+        after->kind = VMAP_FREE;
+        after->next = area->next;
+        area->next = after;
+    } else {
+        vmap_node_put(after);
+    }
+    area->start = start;
+    area->size = size;
+    area->kind = kind;
+    return area;
+}
+
+// Turn 'area' back into free space, merged with free neighbours
+static void vmap_release(vmap_area_t *area) {
+    area->kind = VMAP_FREE;
+    vmap_area_t *next = area->next;
+    if (next != NULL && next->kind == VMAP_FREE) {
+        area->size += next->size;
+        area->next = next->next;
+        vmap_node_put(next);
+    }
+    vmap_area_t *prev = vmap_areas;
+    while (prev != NULL && prev->next != area) {
+        prev = prev->next;
+    }
+    if (prev != NULL && prev->kind == VMAP_FREE) {
+        prev->size += area->size;
+        prev->next = area->next;
+        vmap_node_put(area);
+    }
+}
+
+// Used area containing 'virt', NULL when there is none
+static vmap_area_t *vmap_find(uint32_t virt) {
+    for (vmap_area_t *area = vmap_areas; area != NULL && area->start <= virt; area = area->next) {
+        if (area->kind != VMAP_FREE && virt - area->start < area->size - PAGE_SIZE) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+// Unmap everything but the guard page, which never had a mapping
+static void vmap_unmap(vmap_area_t *area, bool free_frames) {
+    tlb_gather_t gather;
+    tlb_gather_init(&gather);
+    uint32_t end = area->start + area->size - PAGE_SIZE;
+    for (uint32_t virt = area->start; virt != end; virt += PAGE_SIZE) {
+        tlb_gather_unmap(&gather, virt, free_frames);
+    }
+    tlb_gather_flush(&gather);
+}
+
+// ---------------------------------------------------------------------------
+// ioremap
+// ---------------------------------------------------------------------------
+void *ioremap_cache(uint32_t phys_addr, size_t size, cache_type_t type) {
+    if (size == 0 || vmap_areas == NULL) {
+        return (void *)0xFFFFFFFF;
+    }
+    uint32_t base = phys_addr & 0xFFFFF000;
+    uint64_t end = ((uint64_t)phys_addr + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint32_t length = (uint32_t)(end - base);
+
+    uintptr_t flags = irq_save();
+    for (vmap_area_t *area = vmap_areas; area != NULL; area = area->next) {
+        if (area->kind == VMAP_IOREMAP && area->type == type && base >= area->phys &&
+                end <= (uint64_t)area->phys + area->size - PAGE_SIZE) {
+            area->users++;
+            vmap_stats.ioremap_hits++;
+            irq_restore(flags);
+            return (void *)(area->start + (phys_addr - area->phys));
+        }
+    }
+
+    // Large pages need the virtual and the physical side on a 4 MiB boundary
+    uint32_t align = (length >= PAGING_LARGE_PAGE_SIZE && (base & (PAGING_LARGE_PAGE_SIZE - 1)) == 0) ?
+        PAGING_LARGE_PAGE_SIZE : PAGE_SIZE;
+    vmap_area_t *area = length <= VMAP_END - VMAP_BASE - PAGE_SIZE ?
+        vmap_alloc(length + PAGE_SIZE, align, VMAP_IOREMAP) : NULL;
+    if (area == NULL) {
+        irq_restore(flags);
+        terminal_printf("Warning: No room to map 0x%x (%u KiB).\n", phys_addr, length >> 10);
+        return (void *)0xFFFFFFFF;
+    }
+    area->phys = base;
+    area->type = type;
+    area->users = 1;
+    vmap_stats.ioremap_maps++;
+
+    if (type == CACHE_WC && !pat_enabled() && !mtrr_set_range(base, length, CACHE_WC)) {
+        terminal_printf("Warning: No way to make 0x%x write-combining, left uncached.\n", phys_addr);
+    }
+    paging_map_range(area->start, base, length, PAGE_SYSGLOBAL | PAGE_EXECUTE_DISABLE | pat_page_flags(type));
+    irq_restore(flags);
+    return (void *)(area->start + (phys_addr - base));
+}
+
+void *ioremap_nocache(uint32_t phys_addr, size_t size) {
+    return ioremap_cache(phys_addr, size, CACHE_UC);
+}
+
+void iounmap(void *virt) {
+    uintptr_t flags = irq_save();
+    vmap_area_t *area = vmap_find((uint32_t)virt);
+    if (area != NULL && area->kind == VMAP_IOREMAP && --area->users == 0) {
+        vmap_unmap(area, false);
+        vmap_release(area);
+    }
+    irq_restore(flags);
+}
+
+// ---------------------------------------------------------------------------
+// vmalloc
+// ---------------------------------------------------------------------------
+void *vmalloc(size_t size) {
+    if (size == 0 || size > VMAP_END - VMAP_BASE - PAGE_SIZE || vmap_areas == NULL) {
+        return (void *)0xFFFFFFFF;
+    }
+    uint32_t pages = (size + PAGE_SIZE - 1) >> 12;
+
+    uintptr_t flags = irq_save();
+    vmap_area_t *area = vmap_alloc((pages + 1) << 12, PAGE_SIZE, VMAP_VMALLOC);
+    if (area == NULL) {
+        irq_restore(flags);
+        return (void *)0xFFFFFFFF;
+    }
+    // The area was never mapped or was flushed when it was last freed, so
+    // nothing stale can be in the TLB. High memory goes first, it is no use
+    // to anything that needs the identity map.
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t virt = area->start + (i << 12);
+        phys_addr_t frame = frame_alloc_high();
+        if (frame == FRAME_HIGH_NONE) {
+            uint32_t low = frame_alloc_page();
+            frame = low != FRAME_NONE ? low : FRAME_HIGH_NONE;
+        }
+        if (frame != FRAME_HIGH_NONE) {
+            set_page_mapping(virt, frame, PAGE_SYSGLOBAL | PAGE_EXECUTE_DISABLE);
+            if (virt_to_phys(virt) != PAGING_NO_MAPPING) {
+                continue;
+            }
+            // No frame for the page table either
+            frame_free_high(frame);
+        }
+        vmap_stats.failed++;
+        vmap_unmap(area, true);
+        vmap_release(area);
+        irq_restore(flags);
+        return (void *)0xFFFFFFFF;
+    }
+    vmap_stats.vmalloc_pages += pages;
+    irq_restore(flags);
+    return (void *)area->start;
+}
+
+void vfree(void *ptr) {
+    uintptr_t flags = irq_save();
+    vmap_area_t *area = vmap_find((uint32_t)ptr);
+    if (area != NULL && area->kind == VMAP_VMALLOC && area->start == (uint32_t)ptr) {
+        vmap_stats.vmalloc_pages -= (area->size >> 12) - 1;
+        vmap_unmap(area, true);
+        vmap_release(area);
+    }
+    irq_restore(flags);
+}
+
+void vmap_print_stats() {
+    uint32_t used = 0, free_bytes = 0, largest = 0, count = 0;
+    uintptr_t flags = irq_save();
+    for (vmap_area_t *area = vmap_areas; area != NULL; area = area->next) {
+        if (area->kind == VMAP_FREE) {
+            free_bytes += area->size;
+            largest = MAX(largest, area->size);
+        } else {
+            used += area->size;
+            count++;
+        }
+    }
+    irq_restore(flags);
+    terminal_printf("Vmap: %u areas, %u KiB used, %u KiB free, largest free %u KiB\n",
+        count, used >> 10, free_bytes >> 10, largest >> 10);
+    terminal_printf("  ioremap: %u mapped, %u reused; vmalloc: %u pages; %u failed\n",
+        vmap_stats.ioremap_maps, vmap_stats.ioremap_hits, vmap_stats.vmalloc_pages, vmap_stats.failed);
+}
@@ -0,0 +1,291 @@
+// ---------------------------------------------------------------------------
+// Allocator trace replay
+//
+// Runs a trace written by memory_trace_dump against the kernel heap built for
+// the host, and reports time per call, peak footprint and fragmentation. The
+// kernel's memory.c, frame.c and arena.c are compiled straight in, the frame
+// allocator managing an anonymous mapping. It is built as a 32-bit binary so
+// pointers are the size the kernel code takes them to be. Build and run it
+// with scripts/replay.sh, which needs the 32-bit C library (gcc-multilib).
+//
+// The trace is the "@ op size ptr arg tag timestamp" lines of the dump, any
+// other lines (the rest of the debug console log) are skipped.
+// ---------------------------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../../src/drivers/memory.c"
+#include "../../src/drivers/frame.c"
+#include "../../src/drivers/arena.c"
+
+#define REPLAY_REGION_MIN  (16u << 20)
+#define REPLAY_PASSES      10
+
+// ---------------------------------------------------------------------------
+// What the heap expects from the rest of the kernel
+// ---------------------------------------------------------------------------
+uint32_t _cstart, _end;
+multiboot_data_t multiboot_data;
+uint8_t paging_active = 0;
+
+void terminal_printf(const char *format, ...) {}
+void acpi_init(acpi_header_t *header) {}
+void dma_initialize() {}
+void dma_print_stats() {}
+void isr_pool_initialize() {}
+void memory_select_ops() {}
+void *memset_nosse(void *ptr, int value, size_t num) { return memset(ptr, value, num); }
+void outb(uint16_t port, uint8_t value) {}
+uint32_t inl(uint16_t port) { return 0; }
+void set_page_mapping(uint32_t virt, uint32_t phys, PageProperty flags) {}
+uint32_t virt_to_phys(uint32_t virt) { return virt; }
+void unmap_page(void *virt) {}
+void tlb_gather_init(tlb_gather_t *gather) {}
+void tlb_gather_unmap(tlb_gather_t *gather, uint32_t virt, bool free_frame) {}
+void tlb_gather_flush(tlb_gather_t *gather) {}
+void *demand_reserve(size_t size) { return (void *)0xFFFFFFFF; }
+void demand_release(void *ptr, size_t size) {}
+hpet_table_t *hpet_data;
+volatile void *hpet_virt_addr;
+uint64_t hpet_io_port;
+
+// ---------------------------------------------------------------------------
+// Trace loading
+// ---------------------------------------------------------------------------
+typedef struct {
+    char op;
+    uint32_t size;
+    uint32_t ptr;
+    uint32_t arg;
+    uint32_t tag;
+} replay_event_t;
+
+static replay_event_t *replay_load(FILE *file, uint32_t *count) {
+    uint32_t capacity = 4096;
+    replay_event_t *events = malloc(capacity * sizeof(replay_event_t));
+    char line[256];
+    *count = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        replay_event_t event;
+        unsigned int timestamp;
+        if (sscanf(line, "@ %c %x %x %x %x %x", &event.op, &event.size, &event.ptr,
+                &event.arg, &event.tag, &timestamp) != 6) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(replay_event_t));
+        }
+        events[(*count)++] = event;
+    }
+    return events;
+}
+
+// ---------------------------------------------------------------------------
+// Traced pointer -> replayed pointer, open addressing
+// ---------------------------------------------------------------------------
+#define REPLAY_EMPTY 0
+#define REPLAY_DEAD  1
+
+typedef struct {
+    uint32_t key;     // Traced pointer, or REPLAY_EMPTY/REPLAY_DEAD
+    void *ptr;        // Where the replay put it
+    uint32_t size;
+} replay_slot_t;
+
+static replay_slot_t *replay_map;
+static uint32_t replay_map_mask;
+
+static replay_slot_t *replay_find(uint32_t key) {
+    for (uint32_t i = (key >> 4) & replay_map_mask;; i = (i + 1) & replay_map_mask) {
+        if (replay_map[i].key == key) {
+            return &replay_map[i];
+        }
+        if (replay_map[i].key == REPLAY_EMPTY) {
+            return NULL;
+        }
+    }
+}
+
+static void replay_insert(uint32_t key, void *ptr, uint32_t size) {
+    uint32_t i = (key >> 4) & replay_map_mask;
+    while (replay_map[i].key != REPLAY_EMPTY && replay_map[i].key != REPLAY_DEAD) {
+        i = (i + 1) & replay_map_mask;
+    }
+    replay_map[i].key = key;
+    replay_map[i].ptr = ptr;
+    replay_map[i].size = size;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+typedef struct {
+    uint32_t skipped;         // Frees and reallocs of blocks from before the trace
+    uint32_t mismatched;      // Calls that failed in the trace but not here, or the other way round
+    uint32_t live_bytes;
+    uint32_t peak_live;
+    uint32_t base_frames;     // Frames in use before the first call
+    uint32_t peak_frames;     // On top of base_frames
+    mem_stats_t end;          // Heap as the trace left it
+} replay_result_t;
+
+static uint32_t replay_frames_used() {
+    return frame_total_count() - frame_free_count();
+}
+
+static void replay_run(replay_event_t *events, uint32_t count, replay_result_t *result, uint8_t measure) {
+    for (uint32_t i = 0; i < count; i++) {
+        replay_event_t *event = &events[i];
+        replay_slot_t *old = NULL;
+        void *ptr = (void *)0xFFFFFFFF;
+
+        if (event->op == MEM_TRACE_FREE || (event->op == MEM_TRACE_REALLOC && event->arg != 0xFFFFFFFF)) {
+            old = replay_find(event->op == MEM_TRACE_FREE ? event->ptr : event->arg);
+            if (old == NULL) {
+                result->skipped++;
+                continue;
+            }
+        }
+
+        switch (event->op) {
+            case MEM_TRACE_ALLOC:
+                ptr = memalloc_tagged(event->size, event->tag);
+                break;
+            case MEM_TRACE_CALLOC:
+                ptr = memcalloc(event->size, 1);
+                break;
+            case MEM_TRACE_ALIGNED:
+                ptr = mem_alloc_aligned(event->size, event->arg);
+                break;
+            case MEM_TRACE_REALLOC:
+                ptr = memrealloc(old != NULL ? old->ptr : (void *)0xFFFFFFFF, event->size);
+                break;
+            case MEM_TRACE_FREE:
+                memfree(old->ptr);
+                break;
+        }
+
+        if (old != NULL && (event->op == MEM_TRACE_FREE || ptr != (void *)0xFFFFFFFF || event->size == 0)) {
+            result->live_bytes -= old->size;
+            old->key = REPLAY_DEAD;
+        }
+        if (event->op != MEM_TRACE_FREE) {
+            if ((ptr == (void *)0xFFFFFFFF) != (event->ptr == 0xFFFFFFFF)) {
+                result->mismatched++;
+            }
+            if (ptr != (void *)0xFFFFFFFF && event->ptr != 0xFFFFFFFF) {
+                // Still live here means the trace missed its free, drop it so it cannot leak
+                replay_slot_t *stale = replay_find(event->ptr);
+                if (stale != NULL) {
+                    memfree(stale->ptr);
+                    result->live_bytes -= stale->size;
+                    stale->key = REPLAY_DEAD;
+                }
+                replay_insert(event->ptr, ptr, event->size);
+                result->live_bytes += event->size;
+            } else if (ptr != (void *)0xFFFFFFFF) {
+                memfree(ptr);
+            }
+        }
+
+        if (measure) {
+            result->peak_live = MAX(result->peak_live, result->live_bytes);
+            result->peak_frames = MAX(result->peak_frames, replay_frames_used() - result->base_frames);
+        }
+    }
+}
+
+// Free whatever the trace left allocated, so the next pass starts over
+static void replay_release() {
+    for (uint32_t i = 0; i <= replay_map_mask; i++) {
+        if (replay_map[i].key != REPLAY_EMPTY && replay_map[i].key != REPLAY_DEAD) {
+            memfree(replay_map[i].ptr);
+        }
+        replay_map[i].key = REPLAY_EMPTY;
+    }
+}
+
+static double replay_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.log [passes] [heap MiB]\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    uint32_t count;
+    replay_event_t *events = replay_load(file, &count);
+    fclose(file);
+    if (count == 0) {
+        fprintf(stderr, "%s: no trace events\n", argv[1]);
+        return 1;
+    }
+    uint32_t passes = argc > 2 ? atoi(argv[2]) : REPLAY_PASSES;
+    uint32_t region_size = argc > 3 ? (uint32_t)atoi(argv[3]) << 20 : 0;
+    region_size = MAX(region_size, REPLAY_REGION_MIN);
+
+    uint32_t map_size = 1;
+    while (map_size < count * 2) {
+        map_size <<= 1;
+    }
+    replay_map = calloc(map_size, sizeof(replay_slot_t));
+    replay_map_mask = map_size - 1;
+
+    // Hand the heap a memory map with one usable region
+    uint8_t *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    static multiboot_info_t info = { sizeof(multiboot_info_t), 0 };
+    static struct {
+        multiboot_tag_mmap_t tag;
+        multiboot_mmap_entry_t entry;
+    } mmap_info;
+    multiboot_data.ebx_reg = &info;
+    mmap_info.tag.entry_size = sizeof(multiboot_mmap_entry_t);
+    mmap_info.entry.addr_hi = (uint32_t)(uintptr_t)region; // Low dword, see mmap_entry_base
+    mmap_info.entry.len_hi = region_size;
+    mmap_info.entry.type = MULTIBOOT_MEMORY_AVAILABLE;
+    memory_initialize((uint32_t)(uintptr_t)&mmap_info.entry, 1, &mmap_info.tag);
+
+    // The first pass measures footprint, the rest are timed
+    replay_result_t result = { 0 };
+    result.base_frames = replay_frames_used();
+    replay_run(events, count, &result, 1);
+    memory_get_stats(&result.end);
+    replay_release();
+
+    replay_result_t timed = { 0 };
+    double start = replay_now();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        replay_run(events, count, &timed, 0);
+        replay_release();
+    }
+    double elapsed = replay_now() - start;
+
+    mem_stats_t *end = &result.end;
+    uint32_t frag = end->free_bytes ? 100 - (uint64_t)end->largest_free * 100 / end->free_bytes : 0;
+    printf("replay: %u events, %u skipped, %u mismatched\n", count, result.skipped, result.mismatched);
+    printf("  %.1f ns/op over %u passes\n", passes ? elapsed / ((double)count * passes) : 0.0, passes);
+    printf("  peak footprint %u KiB for %u KiB live (%.2fx)\n", result.peak_frames * 4, result.peak_live >> 10,
+        result.peak_live ? (double)result.peak_frames * FRAME_SIZE / result.peak_live : 0.0);
+    printf("  at end: %u KiB used in %u blocks, %u KiB free in %u blocks, largest %u KiB, %u%% fragmented\n",
+        end->used_bytes >> 10, end->used_blocks, end->free_bytes >> 10, end->free_blocks,
+        end->largest_free >> 10, frag);
+    return 0;
+}